@@ -0,0 +1,507 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * replay - replay keystroke scenarios against dmenu on a private Xvfb and
+ * report the latency from each injected key press to the next frame dmenu
+ * puts on its window, as seen by the DAMAGE extension. */
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+#include <X11/extensions/Xdamage.h>
+
+#include "../arg.h"
+#include "../util.h"
+char *argv0;
+
+#define TIMEOUT  1000 /* ms to wait for a frame */
+#define MAXARGS  32
+
+typedef struct {
+	char name[64];
+	char corpus[256]; /* file, or number of generated lines */
+	char *args[MAXARGS];
+	int nargs;
+	double budget[3]; /* p50, p95, p99 in ms, 0 if unchecked */
+	long roundtrips[2]; /* startup budget of the Xlib and XCB builds, 0 if unchecked */
+	char **steps;
+	size_t nsteps;
+} Scenario;
+
+static Display *dpy;
+static Window root, selwin, menu;
+static Atom utf8, targets;
+static int damagebase, damageerr;
+static Damage damage;
+static char *pastetext; /* primary selection we own, set by paste steps */
+static const char *dmenu = "./dmenu";
+static pid_t xvfb;
+
+static double *lat;
+static size_t nlat, latsize, timeouts;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void
+killxvfb(void)
+{
+	if (xvfb > 0)
+		kill(xvfb, SIGTERM);
+}
+
+/* start Xvfb on the first free display and connect to it */
+static void
+startxvfb(void)
+{
+	char fd[16], num[16] = ":";
+	int p[2];
+	ssize_t n;
+
+	if (pipe(p) < 0)
+		die("pipe:");
+	snprintf(fd, sizeof fd, "%d", p[1]);
+	switch ((xvfb = fork())) {
+	case -1:
+		die("fork:");
+	case 0:
+		close(p[0]);
+		execlp("Xvfb", "Xvfb", "-displayfd", fd, "-screen", "0",
+		       "1280x1024x24", "-nolisten", "tcp", (char *)NULL);
+		die("exec Xvfb:");
+	}
+	close(p[1]);
+	atexit(killxvfb);
+	if ((n = read(p[0], num + 1, sizeof num - 2)) <= 0)
+		die("Xvfb did not start");
+	num[n + 1] = '\0';
+	num[strcspn(num, "\n")] = '\0';
+	close(p[0]);
+	setenv("DISPLAY", num, 1);
+	if (!(dpy = XOpenDisplay(num)))
+		die("cannot open display %s", num);
+}
+
+/* answer requests for the paste text, which we own as PRIMARY */
+static void
+selrequest(XSelectionRequestEvent *req)
+{
+	XSelectionEvent ev = { .type = SelectionNotify, .requestor = req->requestor,
+	                       .selection = req->selection, .target = req->target,
+	                       .property = req->property, .time = req->time };
+
+	if (req->target == utf8 || req->target == XA_STRING)
+		XChangeProperty(dpy, req->requestor, req->property, req->target, 8,
+		                PropModeReplace, (unsigned char *)pastetext,
+		                strlen(pastetext));
+	else if (req->target == targets)
+		XChangeProperty(dpy, req->requestor, req->property, XA_ATOM, 32,
+		                PropModeReplace, (unsigned char *)&utf8, 1);
+	else
+		ev.property = None;
+	XSendEvent(dpy, req->requestor, False, NoEventMask, (XEvent *)&ev);
+	XFlush(dpy);
+}
+
+/* wait until the menu window is damaged or until ms have passed,
+ * returns the time of the damage or 0 */
+static double
+waitframe(double ms)
+{
+	struct pollfd pfd = { .fd = ConnectionNumber(dpy), .events = POLLIN };
+	double until = now() + ms;
+	XEvent ev;
+
+	for (;;) {
+		while (XPending(dpy)) {
+			XNextEvent(dpy, &ev);
+			if (ev.type == damagebase + XDamageNotify) {
+				XDamageSubtract(dpy, damage, None, None);
+				return now();
+			} else if (ev.type == SelectionRequest) {
+				selrequest(&ev.xselectionrequest);
+			} else if (ev.type == MapNotify && !menu &&
+			           ev.xmap.override_redirect) {
+				menu = ev.xmap.window;
+			}
+		}
+		if (menu && !damage) {
+			/* count the map as the first frame */
+			damage = XDamageCreate(dpy, menu, XDamageReportNonEmpty);
+			XSync(dpy, False);
+			return now();
+		}
+		if ((ms = until - now()) <= 0)
+			return 0;
+		if (poll(&pfd, 1, (int)ms + 1) < 0 && errno != EINTR)
+			die("poll:");
+	}
+}
+
+/* drop frames until the menu is idle */
+static void
+settle(void)
+{
+	while (waitframe(50))
+		;
+}
+
+static void
+fakekey(KeySym ks, int press)
+{
+	KeyCode kc;
+
+	if (!(kc = XKeysymToKeycode(dpy, ks)))
+		die("no keycode for keysym 0x%lx", ks);
+	XTestFakeKeyEvent(dpy, kc, press, CurrentTime);
+}
+
+/* press and release ks with modifiers and record the time to the frame */
+static void
+stroke(KeySym ks, int ctrl, int shift)
+{
+	double t0, t1;
+
+	if (ctrl)
+		fakekey(XK_Control_L, True);
+	if (shift)
+		fakekey(XK_Shift_L, True);
+	XSync(dpy, False);
+	settle();
+
+	t0 = now();
+	fakekey(ks, True);
+	XFlush(dpy);
+	if ((t1 = waitframe(TIMEOUT))) {
+		if (nlat == latsize && !(lat = realloc(lat, (latsize = 2 * latsize + 64) * sizeof *lat)))
+			die("cannot realloc %zu bytes:", latsize * sizeof *lat);
+		lat[nlat++] = t1 - t0;
+	} else
+		timeouts++;
+
+	fakekey(ks, False);
+	if (shift)
+		fakekey(XK_Shift_L, False);
+	if (ctrl)
+		fakekey(XK_Control_L, False);
+	XSync(dpy, False);
+	settle();
+}
+
+static void
+typechar(int c)
+{
+	KeySym ks = c == ' ' ? XK_space : (KeySym)(unsigned char)c;
+
+	stroke(ks, 0, isupper(c) || strchr("~!@#$%^&*()_+{}|:\"<>?", c));
+}
+
+/* run one step: type text, key name [count], paste text */
+static void
+step(char *s)
+{
+	char *arg = strchr(s, ' '), *name;
+	int i, n, ctrl;
+	KeySym ks;
+
+	if (arg)
+		*arg++ = '\0';
+	else
+		arg = "";
+	if (!strcmp(s, "type")) {
+		for (; *arg; arg++)
+			typechar(*arg);
+	} else if (!strcmp(s, "key")) {
+		name = strtok(arg, " ");
+		n = (arg = strtok(NULL, " ")) ? atoi(arg) : 1;
+		if ((ctrl = !strncmp(name, "ctrl+", 5)))
+			name += 5;
+		if ((ks = XStringToKeysym(name)) == NoSymbol)
+			die("unknown key: %s", name);
+		for (i = 0; i < n; i++)
+			stroke(ks, ctrl, 0);
+	} else if (!strcmp(s, "paste")) {
+		free(pastetext);
+		if (!(pastetext = strdup(arg)))
+			die("strdup:");
+		XSetSelectionOwner(dpy, XA_PRIMARY, selwin, CurrentTime);
+		stroke(XK_v, 1, 0);
+	} else
+		die("unknown step: %s", s);
+}
+
+/* write the corpus of sc to fd: a file, or a number of generated lines */
+static void
+corpus(Scenario *sc, int fd)
+{
+	static const char *parts[] = { "usr", "share", "doc", "lib", "bin", "src",
+		"dmenu", "config", "README", "Makefile", "local", "x11", "font" };
+	FILE *in, *out;
+	char buf[BUFSIZ];
+	size_t n, i, j;
+	unsigned long seed = 1;
+
+	if (!(out = fdopen(fd, "w")))
+		die("fdopen:");
+	if (isdigit((unsigned char)sc->corpus[0])) {
+		for (i = strtoul(sc->corpus, NULL, 10); i; i--) {
+			for (j = 0, n = 2 + i % 4; j < n; j++) {
+				seed = seed * 1103515245 + 12345;
+				fprintf(out, "/%s", parts[(seed >> 16) % LENGTH(parts)]);
+			}
+			fprintf(out, "%lu\n", i);
+		}
+	} else {
+		if (!(in = fopen(sc->corpus, "r")))
+			die("open %s:", sc->corpus);
+		while ((n = fread(buf, 1, sizeof buf, in)))
+			fwrite(buf, 1, n, out);
+		fclose(in);
+	}
+	fclose(out);
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* nearest rank percentile */
+static double
+percentile(int p)
+{
+	size_t r = (p * nlat + 99) / 100;
+
+	return nlat ? lat[r ? r - 1 : 0] : 0;
+}
+
+/* read the startup round trips from the stats dmenu wrote to path,
+ * returns -1 if there are none */
+static long
+startup(const char *path, int *xcb)
+{
+	char buf[BUFSIZ], *s;
+	FILE *fp;
+	long n = -1;
+
+	if (!(fp = fopen(path, "r")))
+		return -1;
+	if (fgets(buf, sizeof buf, fp) &&
+	    (s = strstr(buf, "\"total_ms\":")) && (s = strstr(s, "\"roundtrips\":"))) {
+		n = strtol(s + 13, NULL, 10);
+		*xcb = strstr(buf, "\"xcb\":true") != NULL;
+	}
+	fclose(fp);
+	return n;
+}
+
+static int
+run(Scenario *sc)
+{
+	static const int ps[3] = { 50, 95, 99 };
+	char *argv[MAXARGS + 4], stats[] = "/tmp/replay.XXXXXX";
+	double p[3];
+	long rt = -1;
+	int fds[2], i, fail = 0, status, xcb = 0;
+	size_t s;
+	pid_t pid, feeder;
+
+	nlat = timeouts = 0;
+	menu = None;
+	damage = None;
+	XSelectInput(dpy, root, SubstructureNotifyMask);
+	XSync(dpy, False);
+
+	argv[0] = (char *)dmenu;
+	for (i = 0; i < sc->nargs; i++)
+		argv[i + 1] = sc->args[i];
+	if (sc->roundtrips[0] || sc->roundtrips[1]) {
+		if ((i = mkstemp(stats)) < 0)
+			die("mkstemp:");
+		close(i);
+		argv[sc->nargs + 1] = "-S";
+		argv[sc->nargs + 2] = stats;
+		i = sc->nargs + 2;
+	}
+	argv[i + 1] = NULL;
+	if (pipe(fds) < 0)
+		die("pipe:");
+	switch ((pid = fork())) {
+	case -1:
+		die("fork:");
+	case 0:
+		dup2(fds[0], 0);
+		close(fds[0]);
+		close(fds[1]);
+		if (!freopen("/dev/null", "w", stdout))
+			die("freopen:");
+		execv(dmenu, argv);
+		die("exec %s:", dmenu);
+	}
+	close(fds[0]);
+	/* feed stdin from a child so a large corpus cannot block us */
+	switch ((feeder = fork())) {
+	case -1:
+		die("fork:");
+	case 0:
+		corpus(sc, fds[1]);
+		_exit(0);
+	}
+	close(fds[1]);
+
+	while (!damage)
+		if (!waitframe(10 * TIMEOUT))
+			die("%s: dmenu did not map a window", sc->name);
+	settle();
+	XSelectInput(dpy, root, NoEventMask);
+
+	for (s = 0; s < sc->nsteps; s++)
+		step(sc->steps[s]);
+
+	fakekey(XK_Escape, True);
+	fakekey(XK_Escape, False);
+	XSync(dpy, False);
+	waitpid(pid, &status, 0);
+	waitpid(feeder, NULL, 0);
+	XDamageDestroy(dpy, damage);
+	if (sc->roundtrips[0] || sc->roundtrips[1]) {
+		rt = startup(stats, &xcb);
+		unlink(stats);
+		if (rt < 0 || (sc->roundtrips[xcb] && rt > sc->roundtrips[xcb]))
+			fail = 1;
+	}
+
+	qsort(lat, nlat, sizeof *lat, cmp);
+	printf("%-16s %6zu", sc->name, nlat);
+	for (i = 0; i < 3; i++) {
+		p[i] = percentile(ps[i]);
+		printf(" %8.2f", p[i]);
+		if (sc->budget[i] && p[i] > sc->budget[i])
+			fail = 1;
+	}
+	if (timeouts)
+		fail = 1;
+	printf(" %8zu", timeouts);
+	if (rt >= 0)
+		printf(" %6ld %-4s", rt, xcb ? "xcb" : "xlib");
+	else
+		printf(" %6s %-4s", "-", "");
+	printf("  %s\n", fail ? "FAIL" : "ok");
+	return fail;
+}
+
+/* scenarios are blocks of lines starting with "scenario name", followed by
+ * "corpus", "args", "budget", "roundtrips" and steps; # starts a comment */
+static int
+runfile(const char *path)
+{
+	FILE *fp;
+	Scenario sc;
+	char *line = NULL, *s, *a;
+	size_t size = 0;
+	ssize_t len;
+	int fail = 0, have = 0;
+
+	if (!(fp = fopen(path, "r")))
+		die("open %s:", path);
+	memset(&sc, 0, sizeof sc);
+	for (;;) {
+		len = getline(&line, &size, fp);
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		for (s = line; len >= 0 && isspace((unsigned char)*s); s++)
+			;
+		if (len < 0 || !strncmp(s, "scenario ", 9)) {
+			if (have)
+				fail |= run(&sc);
+			if (len < 0)
+				break;
+			memset(&sc, 0, sizeof sc);
+			snprintf(sc.name, sizeof sc.name, "%s", s + 9);
+			snprintf(sc.corpus, sizeof sc.corpus, "1000");
+			have = 1;
+		} else if (!*s || *s == '#') {
+			continue;
+		} else if (!have) {
+			die("%s: step outside of a scenario: %s", path, s);
+		} else if (!strncmp(s, "corpus ", 7)) {
+			snprintf(sc.corpus, sizeof sc.corpus, "%s", s + 7);
+		} else if (!strncmp(s, "budget ", 7)) {
+			sscanf(s + 7, "%lf %lf %lf", &sc.budget[0], &sc.budget[1], &sc.budget[2]);
+		} else if (!strncmp(s, "roundtrips ", 11)) {
+			sscanf(s + 11, "%ld %ld", &sc.roundtrips[0], &sc.roundtrips[1]);
+		} else if (!strncmp(s, "args ", 5)) {
+			for (a = strtok(strdup(s + 5), " "); a && sc.nargs < MAXARGS; a = strtok(NULL, " "))
+				sc.args[sc.nargs++] = a;
+		} else {
+			if (!(sc.steps = realloc(sc.steps, ++sc.nsteps * sizeof *sc.steps)) ||
+			    !(sc.steps[sc.nsteps - 1] = strdup(s)))
+				die("cannot realloc:");
+		}
+	}
+	free(line);
+	fclose(fp);
+	return fail;
+}
+
+static void
+usage(void)
+{
+	die("usage: %s [-x dmenu] scenariofile...", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int fail = 0, evbase, errbase, major, minor;
+
+	ARGBEGIN {
+	case 'x':
+		dmenu = EARGF(usage());
+		break;
+	default:
+		usage();
+	} ARGEND;
+	if (!argc)
+		usage();
+
+	startxvfb();
+	if (!XTestQueryExtension(dpy, &evbase, &errbase, &major, &minor))
+		die("no XTest extension");
+	if (!XDamageQueryExtension(dpy, &damagebase, &damageerr))
+		die("no DAMAGE extension");
+	root = DefaultRootWindow(dpy);
+	selwin = XCreateSimpleWindow(dpy, root, 0, 0, 1, 1, 0, 0, 0);
+	utf8 = XInternAtom(dpy, "UTF8_STRING", False);
+	targets = XInternAtom(dpy, "TARGETS", False);
+
+	printf("%-16s %6s %8s %8s %8s %8s %11s\n", "scenario", "keys", "p50", "p95",
+	       "p99", "timeouts", "roundtrips");
+	for (; *argv; argv++)
+		fail |= runfile(*argv);
+	XCloseDisplay(dpy);
+	return fail;
+}
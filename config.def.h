@@ -12,6 +12,8 @@ static const char *colors[SchemeLast][2] = {
 	[SchemeNorm] = { "#bbbbbb", "#222222" },
 	[SchemeSel] = { "#eeeeee", "#DC461D" },
 	[SchemeOut] = { "#000000", "#DC731D" },
+	[SchemeNormHl] = { "#DC731D", "#222222" },
+	[SchemeSelHl] = { "#000000", "#DC461D" },
 };
 /* -l option; if nonzero, dmenu uses vertical list with given number of lines */
 static unsigned int lines      = 0;
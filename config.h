@@ -12,6 +12,8 @@ static const char *colors[SchemeLast][2] = {
 	[SchemeNorm] = { "#CFD8DC", "#263238" },
 	[SchemeSel] = { "#E2E2E2", "#DC461D" },
 	[SchemeOut] = { "#000000", "#DC731D" },
+	[SchemeNormHl] = { "#DC731D", "#263238" },
+	[SchemeSelHl] = { "#000000", "#DC461D" },
 };
 /* -l option; if nonzero, dmenu uses vertical list with given number of lines */
 static unsigned int lines = 0;
@@ -13,12 +13,27 @@ XINERAMAFLAGS = -DXINERAMA
 FREETYPELIBS = -lfontconfig -lXft
 FREETYPEINC = /usr/include/freetype2
 
-# includes and libs
+# MIT-SHM client-side rendering, uncomment if you want it
+#SHMLIBS  = -lXext -lfreetype
+#SHMFLAGS = -DSHM
+
+# XCB for asynchronous startup queries, uncomment if you want it
+# (drop -lxcb-xinerama when building without Xinerama)
+#XCBLIBS  = -lX11-xcb -lxcb -lxcb-xinerama
+#XCBFLAGS = -DXCB
+
+# io_uring for the batched checks of stest -j (Linux 5.6), uncomment if you want it
+#IOURINGFLAGS = -DIOURING
+
+# XTest and DAMAGE for the keystroke replay benchmark (make bench)
+BENCHLIBS = -lXtst -lXdamage -lXfixes
+
+# includes and libs (add -lrt for shm_open with glibc before 2.34)
 INCS = -I$(FREETYPEINC)
-LIBS = -lX11 $(XINERAMALIBS) $(FREETYPELIBS)
+LIBS = -lX11 -lpthread $(XINERAMALIBS) $(FREETYPELIBS) $(SHMLIBS) $(XCBLIBS)
 
 # flags
-CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -D_POSIX_C_SOURCE=200809L -DVERSION=\"$(VERSION)\" $(XINERAMAFLAGS)
+CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -D_POSIX_C_SOURCE=200809L -DVERSION=\"$(VERSION)\" $(XINERAMAFLAGS) $(SHMFLAGS) $(XCBFLAGS) $(IOURINGFLAGS)
 CFLAGS   = -std=c99 -pedantic -Wall -O3 $(INCS) $(CPPFLAGS)
 LDFLAGS  = $(LIBS)
 
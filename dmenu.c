@@ -1,12 +1,21 @@
 /* See LICENSE file for copyright and license details. */
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
@@ -14,50 +23,186 @@
 #ifdef XINERAMA
 #include <X11/extensions/Xinerama.h>
 #endif
+#ifdef XCB
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#ifdef XINERAMA
+#include <xcb/xinerama.h>
+#endif
+#endif
 #include <X11/Xft/Xft.h>
 
 #include "drw.h"
+#include "fold.h"
 #include "util.h"
 
 /* macros */
 #define INTERSECT(x,y,w,h,r)  (MAX(0, MIN((x)+(w),(r).x_org+(r).width)  - MAX((x),(r).x_org)) \
                              * MAX(0, MIN((y)+(h),(r).y_org+(r).height) - MAX((y),(r).y_org)))
 #define TEXTW(X)              (drw_fontset_getwidth(drw, (X)) + lrpad)
+#define FIELD(I,K)            (arena + fieldv[(I)->fields + (K)])
+#define FOLDFIELD(I,K)        ((I)->flags & ItemFolded \
+                               ? arena + fieldv[(I)->fields + (I)->nfields + (K)] \
+                               : FIELD(I,K))
+#define MATCH(I)              (&items[sortby ? ordered(I) : matches[(I)]])
+#define MARKED(V,I)           ((V)[(I) / 8] >> ((I) % 8) & 1)
+#define MARK(V,I)             ((V)[(I) / 8] |= 1 << ((I) % 8))
+#define UNMARK(V,I)           ((V)[(I) / 8] &= ~(1 << ((I) % 8)))
+#define ALIGN8(N)             (((N) + 7) & ~(size_t)7)
+#define MAXFIELDS             64 /* the last field keeps any further tabs */
+#define CORPUSMAGIC           0x646d6e63 /* "dmnc" */
+#define CORPUSVERSION         1 /* bump when the layout of the item store changes */
+#define MAXSPANS              16 /* highlighted matches per item */
+#define SORTTHREADS           8
+#define SORTPARALLEL          (1 << 16) /* matches worth sorting in parallel */
 
 /* enums */
-enum { SchemeNorm, SchemeSel, SchemeOut, SchemeLast }; /* color schemes */
-
+enum { SchemeNorm, SchemeSel, SchemeOut, SchemeNormHl, SchemeSelHl,
+       SchemeLast }; /* color schemes */
+enum { PhaseArgs, PhaseDisplay, PhaseDrw, PhaseFonts, PhaseStdin, PhaseGrab,
+       PhaseSetup, PhaseExpose, PhaseLast }; /* startup phases */
+enum { ItemFolded = 1, ItemRemoved = 2 }; /* item flags */
+enum { SortInput, SortLength, SortAlpha, SortPosition }; /* orders of runs */
+
+/* the fields of an item are strings in the arena, tabs replaced by NULs,
+ * and its case folded fields follow them if folding changed anything */
 struct item {
-  struct item *left;
-  struct item *right;
-  char *text;
-  char *value;
-  int out;
+	unsigned int fields; /* arena offsets of the fields in fieldv */
+	unsigned char nfields;
+	unsigned char flags;
+};
+
+/* header of a corpus published in shared memory, see -C; the arrays of the
+ * item store follow at the given offsets */
+struct corpus {
+	unsigned int magic, version, itembytes;
+	volatile int ready; /* set last by the publisher */
+	unsigned long long dev, ino, size, mtime, mtimens; /* of the file */
+	unsigned long long nitems, nfieldv, arenalen, nkeyed, inputbytes;
+	unsigned long long items, fieldv, arena, keyidx, total;
 };
 
-static char text[BUFSIZ] = "";
+static char *text; /* input, textsize bytes allocated */
+static size_t textlen, textsize;
 static char *embed;
 static int bh, mw, mh;
+static int sw, sh; /* size of the parent window */
 static int inputw = 0, promptw, sif = 0;
 static int lrpad; /* sum of left and right padding */
 static size_t cursor;
 static struct item *items = NULL;
-static struct item *matches, *matchend;
-static struct item *prev, *curr, *next, *sel;
+static size_t nitems, itemsize;
+static char *arena; /* item text, addressed by 32-bit offsets */
+static size_t arenalen, arenasize;
+static unsigned char *outmarks, *keymarks; /* bits by item index */
+static size_t marksize;
+static const char *corpusfile; /* shared between instances, see -C */
+static char *shmbase; /* private mapping of an attached corpus */
+static size_t shmsize;
+static unsigned int *matches; /* indices of the matching items in display order */
+static size_t nmatches, nexact, nprefixed; /* exact and prefix matches go first */
+static unsigned int *rest, *prevv; /* scratch as large as matches */
+static int sortby = SortInput;
+static unsigned int *order; /* matches in display order, see -O */
+static size_t nordered; /* leading part of order that is final */
+static size_t nkeyorder; /* leading part of order whose sort keys are set */
+static int orderdirty;
+static unsigned int matchgen = 1; /* bumped whenever the matches change */
+static unsigned int *sortkey; /* by item index */
+static unsigned int *keyidx; /* items by their folded key, see keyindex() */
+static size_t nkeyed, keyidxsize; /* the items before nkeyed are indexed */
+static struct {
+	pthread_t thread;
+	int running, done;
+	unsigned int *v; /* index of the items before n */
+	size_t n;
+} keybuild; /* an index being sorted in the background, see keystart() */
+static size_t matchsize;
+static const char *query; /* input as compared with the items */
+static size_t querylen;
+static int regexed; /* the matches come from the regex */
+static regex_t re, resub; /* resub reports offsets, compiled when needed */
+static int resubbed;
+static char *relitbuf; /* longest literal of the regex */
+static size_t prev, curr, next, sel; /* positions in matches */
+static size_t *pages, npages, pagessize; /* known horizontal page starts */
+struct spans {
+	unsigned int item, gen, n;
+	unsigned int v[2 * MAXSPANS];
+};
+static struct spans *pagehl; /* highlights of the shown items, see pagespans() */
+static size_t pagehlsize;
+struct token {
+	size_t off, len; /* in text */
+	char *fold; /* copy matched against the items */
+	int dirty; /* changed since the last match */
+};
+static struct token *tokv;
+static size_t tokc, toksize;
+static int refine = 0; /* tokens were only refined or added since the last match */
+static unsigned int *fieldv; /* field offsets of all items */
+static size_t nfieldv, fieldvsize;
+static unsigned long long matchfields = 1, outfields = ~1ULL; /* bit k: field k+1 */
+static unsigned int dispfield = 0;
 static int mon = -1, screen;
-
+static int fast = 0; /* grab the keyboard before reading stdin */
+static int useregex = 0; /* match the input as an extended regex */
+static char *outbuf; /* selections, written at exit with -B */
+static size_t outlen, outsize;
+static int outsep = '\n', outindex = 0, outbuffered = 0;
+static pthread_t reader;
+static int followfd = -1; /* followed input, see -F and -c */
+static int protocol = 0; /* followed input is commands, events go to stdout */
+static int querychanged = 0;
+static ssize_t keep; /* item to keep selected after followed input */
+static char *promptbuf; /* prompt set by a command */
+
+/* startup profile, see -S */
+static const char *statsfile;
+static const char *phasenames[PhaseLast] = {
+	[PhaseArgs] = "args", [PhaseDisplay] = "XOpenDisplay",
+	[PhaseDrw] = "drw_create", [PhaseFonts] = "drw_fontset_create",
+	[PhaseStdin] = "readstdin", [PhaseGrab] = "grabkeyboard",
+	[PhaseSetup] = "setup", [PhaseExpose] = "expose",
+};
+static struct {
+	double start, end; /* ms since main() */
+	long roundtrips;   /* -1 if not counted */
+	int done;
+} phases[PhaseLast];
+static struct timespec t0;
+static long roundtrips;
+static unsigned long lastread;
+static size_t inputbytes;
+static unsigned long nallocs; /* allocations of the item store */
+static int dirty, matchdirty; /* pending redraw and rematch */
+
+static char *atomnames[] = { "CLIPBOARD", "UTF8_STRING" };
 static Atom clip, utf8;
 static Display *dpy;
 static Window root, parentwin, win;
 static XIC xic;
+#ifdef XCB
+static struct {
+	xcb_intern_atom_cookie_t atoms[LENGTH(atomnames)];
+	xcb_get_geometry_cookie_t parent;
+#ifdef XINERAMA
+	xcb_get_input_focus_cookie_t focus;
+	xcb_query_pointer_cookie_t pointer;
+#endif
+} cookies; /* startup queries in flight */
+static int xcbbatch; /* replies of the startup queries not waited for yet */
+#endif
 
 static Drw *drw;
 static Clr *scheme[SchemeLast];
 
-static void freeitem(struct item *item);
 static void freeitems(void);
-static void inititem(struct item *item, char *val);
-static char *getitemval(struct item *item);
+static void keyadopt(int wait);
+static void inititem(struct item *item, const char *val);
+static void flushmatch(void);
+static unsigned int ordered(size_t i);
+static void pagespans(void);
 
 #include "config.h"
 
@@ -65,6 +210,94 @@ static char * cistrstr(const char *s, const char *sub);
 static int (*fstrncmp)(const char *, const char *, size_t) = strncasecmp;
 static char *(*fstrstr)(const char *, const char *) = cistrstr;
 
+static double
+elapsed(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - t0.tv_sec) * 1e3 + (ts.tv_nsec - t0.tv_nsec) / 1e6;
+}
+
+/* Xlib calls this after every request; a request whose reply has been
+ * read, leaving nothing outstanding, was a synchronous round trip. */
+static int
+countroundtrip(Display *d)
+{
+	unsigned long r = LastKnownRequestProcessed(d);
+
+	if (r != lastread && r == NextRequest(d) - 1)
+		roundtrips++;
+	lastread = r;
+	return 0;
+}
+
+static void
+phasebegin(int p)
+{
+	if (!statsfile)
+		return;
+	phases[p].start = elapsed();
+	/* the reader thread does not talk to X and must not touch the counter */
+	phases[p].roundtrips = (p == PhaseStdin || p == PhaseDisplay) ? -1 : roundtrips;
+}
+
+static void
+phaseend(int p)
+{
+	if (!statsfile)
+		return;
+	phases[p].end = elapsed();
+	if (phases[p].roundtrips >= 0)
+		phases[p].roundtrips = roundtrips - phases[p].roundtrips;
+	phases[p].done = 1;
+}
+
+static void
+writestats(void)
+{
+	struct rusage ru;
+	FILE *fp;
+	size_t store;
+	int i, n = 0;
+
+	if (!(fp = strcmp(statsfile, "-") ? fopen(statsfile, "w") : stderr)) {
+		fprintf(stderr, "dmenu: cannot open %s: %s\n", statsfile, strerror(errno));
+		return;
+	}
+	fprintf(fp, "{\"version\":\"%s\",\"xcb\":%s,\"phases\":[", VERSION,
+#ifdef XCB
+	        "true");
+#else
+	        "false");
+#endif
+	for (i = 0; i < PhaseLast; i++) {
+		if (!phases[i].done)
+			continue;
+		fprintf(fp, "%s{\"name\":\"%s\",\"start_ms\":%.3f,\"ms\":%.3f,\"roundtrips\":",
+		        n++ ? "," : "", phasenames[i], phases[i].start,
+		        phases[i].end - phases[i].start);
+		if (phases[i].roundtrips < 0)
+			fputs("null}", fp);
+		else
+			fprintf(fp, "%ld}", phases[i].roundtrips);
+	}
+	fprintf(fp, "],\"total_ms\":%.3f,\"roundtrips\":%ld,",
+	        phases[PhaseExpose].end, roundtrips);
+	getrusage(RUSAGE_SELF, &ru);
+	store = itemsize * sizeof *items + arenasize + fieldvsize * sizeof *fieldv +
+	        (sortby ? 5 : 3) * matchsize * sizeof *matches +
+	        keyidxsize * sizeof *keyidx;
+	fprintf(fp, "\"memory\":{\"items\":%zu,\"input_bytes\":%zu,\"store_bytes\":%zu,"
+	        "\"bytes_per_item\":%.1f,\"allocs\":%lu,\"peak_rss_kb\":%ld}}\n",
+	        nitems, inputbytes, store, nitems ? (double)store / nitems : 0.0,
+	        nallocs, ru.ru_maxrss);
+	if (fp != stderr)
+		fclose(fp);
+	else
+		fflush(fp);
+}
+
 static unsigned int
 textw_clamp(const char *str, unsigned int n)
 {
@@ -72,88 +305,240 @@ textw_clamp(const char *str, unsigned int n)
 	return MIN(w, n);
 }
 
-static void
-appenditem(struct item *item, struct item **list, struct item **last)
+/* displayed field of item */
+static char *
+itemtext(struct item *item)
 {
-	if (*last)
-		(*last)->right = item;
-	else
-		*list = item;
+	if (dispfield < item->nfields)
+		return FIELD(item, dispfield);
+	return strchr(FIELD(item, item->nfields - 1), '\0'); /* empty */
+}
 
-	item->left = *last;
-	item->right = NULL;
-	*last = item;
+/* width available to the items of a horizontal page */
+static int
+pagewidth(void)
+{
+	return mw - (promptw + inputw + TEXTW("") + TEXTW(""));
+}
+
+/* index of curr in the page index, or -1 if it does not start a known page */
+static ssize_t
+findpage(void)
+{
+	size_t lo = 0, hi = npages, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pages[mid] < curr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < npages && pages[lo] == curr) ? (ssize_t)lo : -1;
 }
 
 static void
 calcoffsets(void)
 {
 	int i, n;
+	ssize_t k;
 
-	if (lines > 0)
-		n = lines * bh;
-	else
-		n = mw - (promptw + inputw + TEXTW("") + TEXTW(""));
+	/* vertical pages hold exactly lines items */
+	if (lines > 0) {
+		next = MIN(curr + lines, nmatches);
+		prev = curr > (size_t)lines ? curr - lines : 0;
+		return;
+	}
+	n = pagewidth();
+	if (!npages) {
+		if (!pagessize && !(pages = malloc((pagessize = 64) * sizeof *pages)))
+			die("cannot malloc %zu bytes:", pagessize * sizeof *pages);
+		pages[npages++] = 0;
+	}
+	/* pages visited before are looked up, not measured again */
+	if ((k = findpage()) >= 0 && (size_t)k + 1 < npages) {
+		next = pages[k + 1];
+		prev = k ? pages[k - 1] : 0;
+		return;
+	}
 	/* calculate which items will begin the next page and previous page */
-	for (i = 0, next = curr; next; next = next->right)
-		if ((i += (lines > 0) ? bh : textw_clamp(next->text, n)) > n)
+	for (i = 0, next = curr; next < nmatches; next++)
+		if ((i += textw_clamp(itemtext(MATCH(next)), n)) > n)
 			break;
-	for (i = 0, prev = curr; prev && prev->left; prev = prev->left)
-		if ((i += (lines > 0) ? bh : textw_clamp(prev->left->text, n)) > n)
+	if (k >= 0) {
+		prev = k ? pages[k - 1] : 0;
+		if (next < nmatches) {
+			if (npages == pagessize &&
+			    !(pages = realloc(pages, (pagessize *= 2) * sizeof *pages)))
+				die("cannot realloc %zu bytes:", pagessize * sizeof *pages);
+			pages[npages++] = next;
+		}
+		return;
+	}
+	for (i = 0, prev = curr; prev > 0; prev--)
+		if ((i += textw_clamp(itemtext(MATCH(prev - 1)), n)) > n)
 			break;
 }
 
+/* resize an array of the item store, which is copied out of an attached
+ * corpus rather than reallocated */
+static void *
+storegrow(void *p, size_t len, size_t size)
+{
+	void *q;
+
+	if (shmbase && (char *)p >= shmbase && (char *)p < shmbase + shmsize) {
+		if ((q = malloc(size)))
+			memcpy(q, p, len);
+	} else {
+		q = realloc(p, size);
+	}
+	if (!q)
+		die("cannot realloc %zu bytes:", size);
+	nallocs++;
+	return q;
+}
+
 static void
-inititem(struct item *item, char *val)
+storefree(void *p)
 {
-  /* value */
-  char *p = strchr(val, '\t');
-  if (p == NULL)
-    item->value = NULL;
-  else {
-    *p++ = '\0';
+	if (!shmbase || (char *)p < shmbase || (char *)p >= shmbase + shmsize)
+		free(p);
+}
 
-    item->value = strdup(p);
-    if (item->value == NULL)
-      die("cannot strdup %zu bytes:", strlen(p) + 1);
-  }
+/* make the item marks cover n items */
+static void
+growmarks(size_t n)
+{
+	size_t size = n / 8 + 1;
 
-  /* text */
-  item->text = strdup(val);
-	if (item->text == NULL)
-    die("cannot strdup %zu bytes:", strlen(val) + 1);
+	if (size <= marksize)
+		return;
+	if (!(outmarks = realloc(outmarks, size)) || !(keymarks = realloc(keymarks, size)))
+		die("cannot realloc %zu bytes:", size);
+	memset(outmarks + marksize, 0, size - marksize);
+	memset(keymarks + marksize, 0, size - marksize);
+	marksize = size;
+}
 
-  item->out = 0;
+static void
+pushfield(size_t off)
+{
+	if (nfieldv == fieldvsize) {
+		fieldvsize = fieldvsize ? 2 * fieldvsize : 1024;
+		fieldv = storegrow(fieldv, nfieldv * sizeof *fieldv, fieldvsize * sizeof *fieldv);
+	}
+	fieldv[nfieldv++] = off;
 }
 
-static char *
-getitemval(struct item *item)
+/* make room for n more bytes in the arena, which moves it */
+static void
+arenareserve(size_t n)
 {
-  if (item->value != NULL)
-    return item->value;
-  return item->text;
+	if (arenalen + n <= arenasize)
+		return;
+	if (arenalen + n > UINT_MAX)
+		die("input too large");
+	arenasize = MIN(MAX(2 * arenasize, arenalen + n + BUFSIZ), UINT_MAX);
+	arena = storegrow(arena, arenalen, arenasize);
 }
 
+/* keep a case folded copy of the fields of an item with non-ASCII text,
+ * its field offsets follow those of the line in fieldv */
 static void
-freeitem(struct item *item)
+foldfields(struct item *item)
 {
-	free(item->text);
-	free(item->value);
+	size_t len, n;
+	unsigned int k;
+	int changed = 0;
+	char *p, *end;
+
+	end = strchr(FIELD(item, item->nfields - 1), '\0');
+	for (p = FIELD(item, 0); p < end && !(*p & 0x80); p++)
+		;
+	if (p == end)
+		return;
+	len = end - FIELD(item, 0) + 1;
+	arenareserve(FOLDSIZE(len));
+	for (k = 0, n = arenalen; k < item->nfields; k++) {
+		pushfield(n);
+		changed |= utf8fold(arena + n, FIELD(item, k));
+		n += strlen(arena + n) + 1;
+	}
+	if (!changed) {
+		nfieldv -= item->nfields;
+		return;
+	}
+	arenalen = n;
+	item->flags |= ItemFolded;
+}
+
+static void
+inititem(struct item *item, const char *val)
+{
+	size_t len = strlen(val) + 1;
+	char *p, *line;
+
+	arenareserve(len);
+	line = memcpy(arena + arenalen, val, len);
+	arenalen += len;
+
+	/* split the line into tab-separated fields */
+	item->fields = nfieldv;
+	for (p = line, item->nfields = 0; ; item->nfields++) {
+		pushfield(p - arena);
+		if (item->nfields + 1 == MAXFIELDS || !(p = strchr(p, '\t')))
+			break;
+		*p++ = '\0';
+	}
+	item->nfields++;
+
+	item->flags = 0;
+	if (fstrstr == cistrstr)
+		foldfields(item);
 }
 
+/* parse a list of fields like "1,3-4,6-" into a mask */
+static unsigned long long
+fieldlist(const char *arg)
+{
+	const char *s = arg;
+	unsigned long long mask = 0;
+	unsigned long a, b;
+	char *end;
+
+	for (;;) {
+		a = b = strtoul(s, &end, 10);
+		if (end == s)
+			die("invalid field list: %s", arg);
+		if (*end == '-') {
+			s = end + 1;
+			if (isdigit((unsigned char)*s)) {
+				b = strtoul(s, &end, 10);
+			} else {
+				b = MAXFIELDS; /* open range */
+				end = (char *)s;
+			}
+		}
+		if (a < 1 || a > b || b > MAXFIELDS || (*end && *end != ','))
+			die("invalid field list: %s", arg);
+		for (; a <= b; a++)
+			mask |= 1ULL << (a - 1);
+		if (!*end)
+			return mask;
+		s = end + 1;
+	}
+}
 
 static void
 freeitems(void)
 {
-	size_t i;
-
-  if (items == NULL)
-    return;
-  
-  for (i = 0; items[i].text != NULL; ++i)
-		freeitem(&items[i]);
-	
-  free(items);
+	storefree(items);
+	storefree(arena);
+	items = NULL;
+	arena = NULL;
+	nitems = itemsize = arenalen = arenasize = nfieldv = 0;
+	memset(outmarks, 0, marksize);
 }
 
 static void
@@ -165,50 +550,73 @@ cleanup(void)
 	for (i = 0; i < SchemeLast; i++)
 		free(scheme[i]);
 
-  freeitems();
+	/* a sort still running reads the items, exiting frees them anyway */
+	keyadopt(0);
+	if (!keybuild.running)
+		freeitems();
+	free(matches);
+	free(pages);
+	free(pagehl);
+	storefree(fieldv);
+	free(text);
 
 	drw_free(drw);
-	XSync(dpy, False);
-	XCloseDisplay(dpy);
+	XCloseDisplay(dpy); /* syncs */
+
+	fwrite(outbuf, 1, outlen, stdout);
+	free(outbuf);
 }
 
 static char *
 cistrstr(const char *h, const char *n)
 {
-	size_t i;
+	char first[3];
+	size_t len;
 
 	if (!n[0])
 		return (char *)h;
 
-	for (; *h; ++h) {
-		for (i = 0; n[i] && tolower((unsigned char)n[i]) == tolower((unsigned char)h[i]); ++i)
-			;
-		if (n[i] == '\0')
+	/* strpbrk and strncasecmp are vectorized in common libcs */
+	first[0] = tolower((unsigned char)n[0]);
+	first[1] = toupper((unsigned char)n[0]);
+	first[2] = '\0';
+	len = strlen(n + 1);
+	for (; (h = strpbrk(h, first)); h++)
+		if (!strncasecmp(h + 1, n + 1, len))
 			return (char *)h;
-	}
 	return NULL;
 }
 
 static int
-drawitem(struct item *item, int x, int y, int w)
+drawitem(struct item *item, const struct spans *spans, int x, int y, int w)
 {
-	if (item == sel)
+	int hl = -1;
+
+	if (item == MATCH(sel)) {
 		drw_setscheme(drw, scheme[SchemeSel]);
-	else if (item->out)
+		hl = SchemeSelHl;
+	} else if (MARKED(outmarks, item - items)) {
 		drw_setscheme(drw, scheme[SchemeOut]);
-	else
+	} else {
 		drw_setscheme(drw, scheme[SchemeNorm]);
+		hl = SchemeNormHl;
+	}
+	if (hl >= 0)
+		drw_sethl(drw, scheme[hl], spans->v, spans->n);
 
-	return drw_text(drw, x, y, w, bh, lrpad / 2, item->text, 0);
+	return drw_text(drw, x, y, w, bh, lrpad / 2, itemtext(item), 0);
 }
 
 static void
 drawmenu(void)
 {
 	unsigned int curpos;
-	struct item *item;
+	size_t i;
 	int x = 0, y = 0, w;
 
+	flushmatch();
+	pagespans();
+	dirty = 0;
 	drw_setscheme(drw, scheme[SchemeNorm]);
 	drw_rect(drw, 0, 0, mw, mh, 1, 1);
 
@@ -217,11 +625,11 @@ drawmenu(void)
 		x = drw_text(drw, x, 0, promptw, bh, lrpad / 2, prompt, 0);
 	}
 	/* draw input field */
-	w = (lines > 0 || !matches) ? mw - x : inputw;
+	w = (lines > 0 || !nmatches) ? mw - x : inputw;
 	drw_setscheme(drw, scheme[SchemeNorm]);
 	if (sif & 1) {
-	  char *censort = ecalloc(1, sizeof(text));
-	  memset(censort, '.', strlen(text));
+	  char *censort = ecalloc(1, textlen + 1);
+	  memset(censort, '.', textlen);
 	  drw_text(drw, x, 0, w, bh, lrpad / 2, censort, 0);
 	  free(censort);
 	} else
@@ -235,20 +643,20 @@ drawmenu(void)
 
 	if (lines > 0) {
 		/* draw vertical list */
-		for (item = curr; item != next; item = item->right)
-			drawitem(item, x, y += bh, mw - x);
-	} else if (matches) {
+		for (i = curr; i < next; i++)
+			drawitem(MATCH(i), &pagehl[i - curr], x, y += bh, mw - x);
+	} else if (nmatches) {
 		/* draw horizontal list */
 		x += inputw;
 		w = TEXTW("");
-		if (curr->left) {
+		if (curr > 0) {
 			drw_setscheme(drw, scheme[SchemeNorm]);
 			drw_text(drw, x, 0, w, bh, lrpad / 2, "", 0);
 		}
 		x += w;
-		for (item = curr; item != next; item = item->right)
-			x = drawitem(item, x, 0, textw_clamp(item->text, mw - x - TEXTW("")));
-		if (next) {
+		for (i = curr; i < next; i++)
+			x = drawitem(MATCH(i), &pagehl[i - curr], x, 0, textw_clamp(itemtext(MATCH(i)), mw - x - TEXTW("")));
+		if (next < nmatches) {
 			w = TEXTW("");
 			drw_setscheme(drw, scheme[SchemeNorm]);
 			drw_text(drw, mw - w, 0, w, bh, lrpad / 2, "", 0);
@@ -257,106 +665,1062 @@ drawmenu(void)
 	drw_map(drw, win, 0, 0, mw, mh);
 }
 
+/* Wait for new data on the X connection until the given time in ms since
+ * startup. Returns 0 once that time has passed. */
+static int
+waitevent(double until)
+{
+	struct pollfd pfd = { .fd = ConnectionNumber(dpy), .events = POLLIN };
+	double ms = until - elapsed();
+
+	if (ms <= 0)
+		return 0;
+	if (poll(&pfd, 1, (int)ms + 1) == -1 && errno != EINTR)
+		die("poll:");
+	return 1;
+}
+
 static void
 grabfocus(void)
 {
-	struct timespec ts = { .tv_sec = 0, .tv_nsec = 10000000  };
+	double until = elapsed() + 1000;
 	Window focuswin;
-	int i, revertwin;
+	int revertwin;
+	XEvent ev;
 
-	for (i = 0; i < 100; ++i) {
-		XGetInputFocus(dpy, &focuswin, &revertwin);
-		if (focuswin == win)
-			return;
-		XSetInputFocus(dpy, win, RevertToParent, CurrentTime);
-		nanosleep(&ts, NULL);
+	/* the server sends no FocusIn when we already have the focus */
+	XGetInputFocus(dpy, &focuswin, &revertwin);
+	if (focuswin == win)
+		return;
+	XSetInputFocus(dpy, win, RevertToParent, CurrentTime);
+	/* the FocusIn event tells when the focus has arrived */
+	while (!XCheckTypedWindowEvent(dpy, win, FocusIn, &ev)) {
+		if (!waitevent(until)) {
+			XGetInputFocus(dpy, &focuswin, &revertwin);
+			if (focuswin != win)
+				die("cannot grab focus");
+			break;
+		}
 	}
-	die("cannot grab focus");
 }
 
 static void
 grabkeyboard(void)
 {
-	struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000  };
-	int i;
+	double until, retry = 1;
+	XEvent ev;
+	int grabbed;
 
 	if (embed)
 		return;
-	/* try to grab keyboard, we may have to wait for another process to ungrab */
-	for (i = 0; i < 1000; i++) {
-		if (XGrabKeyboard(dpy, DefaultRootWindow(dpy), True, GrabModeAsync,
-		                  GrabModeAsync, CurrentTime) == GrabSuccess)
+	phasebegin(PhaseGrab);
+	if (XGrabKeyboard(dpy, DefaultRootWindow(dpy), True, GrabModeAsync,
+	                  GrabModeAsync, CurrentTime) == GrabSuccess) {
+		phaseend(PhaseGrab);
+		return;
+	}
+	/* another client holds the keyboard: retry as soon as a grab is
+	 * released, which shows as focus events on the root window, and
+	 * with a backing off timer in case that notification never comes */
+	until = elapsed() + 1000;
+	XSelectInput(dpy, root, FocusChangeMask);
+	do {
+		waitevent(MIN(elapsed() + retry, until));
+		while (XCheckWindowEvent(dpy, root, FocusChangeMask, &ev))
+			;
+		retry = MIN(retry * 2, 16);
+		grabbed = XGrabKeyboard(dpy, DefaultRootWindow(dpy), True, GrabModeAsync,
+		                        GrabModeAsync, CurrentTime) == GrabSuccess;
+	} while (!grabbed && elapsed() < until);
+	/* drop the focus events caused by our own grab, run() must not see them */
+	XSelectInput(dpy, root, NoEventMask);
+	XSync(dpy, False);
+	while (XCheckWindowEvent(dpy, root, FocusChangeMask, &ev))
+		;
+	if (!grabbed)
+		die("cannot grab keyboard");
+	phaseend(PhaseGrab);
+}
+
+/* first matched field of item that contains s */
+static char *
+fieldstr(struct item *item, const char *s)
+{
+	unsigned int k;
+	char *p;
+
+	if (matchfields == 1)
+		return fstrstr(FOLDFIELD(item, 0), s);
+	for (k = 0; k < item->nfields; k++)
+		if ((matchfields >> k & 1) && (p = fstrstr(FOLDFIELD(item, k), s)))
+			return p;
+	return NULL;
+}
+
+/* first matched field of item, compared against the whole input */
+static char *
+fieldkey(struct item *item)
+{
+	unsigned int k;
+
+	for (k = 0; k < item->nfields; k++)
+		if (matchfields >> k & 1)
+			return FOLDFIELD(item, k);
+	return strchr(FOLDFIELD(item, item->nfields - 1), '\0');
+}
+
+/* end of the bracket expression or group starting at p */
+static const char *
+reskip(const char *p)
+{
+	int depth;
+	char c;
+
+	if (*p == '[') {
+		if (*++p == '^')
+			p++;
+		if (*p == ']')
+			p++;
+		for (; *p && *p != ']'; p++) {
+			if (p[0] != '[' || !p[1] || !strchr(":=.", p[1]))
+				continue;
+			/* character class, equivalence class or collating symbol */
+			for (c = p[1], p += 2; *p && !(p[0] == c && p[1] == ']'); p++)
+				;
+			if (!*p)
+				break;
+			p++;
+		}
+		return *p ? p : p - 1;
+	}
+	for (depth = 1, p++; *p; p++) {
+		if (*p == '\\' && p[1])
+			p++;
+		else if (*p == '[')
+			p = reskip(p);
+		else if (*p == '(')
+			depth++;
+		else if (*p == ')' && !--depth)
+			return p;
+	}
+	return p - 1;
+}
+
+/* longest literal which every match of the extended regex re contains,
+ * empty if there is none */
+static void
+relit(const char *re, char *lit)
+{
+	char *cur = ecalloc(1, strlen(re) + 1);
+	size_t n = 0, best = 0;
+	int icase = fstrstr == cistrstr;
+
+	*lit = '\0';
+	for (; *re; re++) {
+		switch (*re) {
+		case '|': /* alternatives do not share a required literal */
+			*lit = '\0';
+			free(cur);
 			return;
-		nanosleep(&ts, NULL);
+		case '*':
+		case '?':
+		case '{':
+			/* the previous character is optional */
+			while (n > 0 && (cur[n - 1] & 0xc0) == 0x80)
+				n--;
+			if (n > 0)
+				n--;
+			if (*re == '{')
+				while (re[1] && *re != '}')
+					re++;
+			break;
+		case '[':
+		case '(':
+			re = reskip(re);
+			break;
+		case '\\':
+			if (re[1] && strchr(".[]()*+?{}|^$\\", re[1])) {
+				cur[n++] = *++re;
+				continue;
+			}
+			if (re[1])
+				re++;
+			break;
+		case '+': case '.': case '^': case '$': case ')': case '}':
+			break;
+		default:
+			/* REG_ICASE may fold non-ASCII unlike the fold table */
+			if (icase && (unsigned char)*re >= 0x80)
+				break;
+			cur[n++] = *re;
+			continue;
+		}
+		/* end of a run of literal characters */
+		if (n > best) {
+			memcpy(lit, cur, n);
+			lit[best = n] = '\0';
+		}
+		n = 0;
+	}
+	if (n > best) {
+		memcpy(lit, cur, n);
+		lit[n] = '\0';
+	}
+	free(cur);
+}
+
+/* compile the input as an extended regex and find its longest literal,
+ * returns 0 if the input does not compile (yet) */
+static int
+recompile(void)
+{
+	static int compiled = 0;
+
+	if (compiled)
+		regfree(&re);
+	if (resubbed)
+		regfree(&resub);
+	resubbed = 0;
+	compiled = !regcomp(&re, text, REG_EXTENDED | REG_NOSUB |
+	                    (fstrstr == cistrstr ? REG_ICASE : 0));
+	if (!compiled)
+		return 0;
+	free(relitbuf);
+	relit(text, relitbuf = ecalloc(1, textlen + 1));
+	return 1;
+}
+
+/* the regex compiled to report the offsets of its matches, which only the
+ * spans and -O position need */
+static regex_t *
+subre(void)
+{
+	if (!resubbed)
+		resubbed = !regcomp(&resub, text, REG_EXTENDED |
+		                    (fstrstr == cistrstr ? REG_ICASE : 0));
+	return resubbed ? &resub : NULL;
+}
+
+/* whether item matches the compiled regex, prefiltered by its literal;
+ * -O position keeps the offset of the match as its sort key */
+static int
+rematch(struct item *item)
+{
+	regmatch_t m;
+	regex_t *r = sortby == SortPosition ? subre() : NULL;
+	unsigned int k;
+
+	if (*relitbuf && !fieldstr(item, relitbuf))
+		return 0;
+	for (k = 0; k < item->nfields; k++) {
+		if (!(matchfields >> k & 1) ||
+		    (r ? regexec(r, FIELD(item, k), 1, &m, 0)
+		       : regexec(&re, FIELD(item, k), 0, NULL, 0)))
+			continue;
+		if (sortby == SortPosition)
+			sortkey[item - items] = r ? m.rm_so : 0;
+		return 1;
+	}
+	return 0;
+}
+
+static void
+outappend(const char *s, size_t len)
+{
+	if (outlen + len > outsize) {
+		outsize = MAX(2 * outsize, outlen + len + BUFSIZ);
+		if (!(outbuf = realloc(outbuf, outsize)))
+			die("cannot realloc %zu bytes:", outsize);
+	}
+	memcpy(outbuf + outlen, s, len);
+	outlen += len;
+}
+
+/* output a selection, the input text if item is NULL */
+static void
+output(struct item *item)
+{
+	char num[32], sep = outsep;
+	unsigned int k, n = 0;
+	size_t start = outlen;
+
+	if (outindex) {
+		snprintf(num, sizeof num, "%zu", item ? (size_t)(item - items) + 1 : 0);
+		outappend(num, strlen(num));
+	} else if (!item) {
+		outappend(text, strlen(text));
+	} else {
+		/* the output fields joined by tabs, else the displayed one */
+		for (k = 0; k < item->nfields; k++) {
+			if (!(outfields >> k & 1))
+				continue;
+			if (n++)
+				outappend("\t", 1);
+			outappend(FIELD(item, k), strlen(FIELD(item, k)));
+		}
+		if (!n)
+			outappend(itemtext(item), strlen(itemtext(item)));
+	}
+	outappend(&sep, 1);
+	/* the host gets selections right away */
+	if (protocol) {
+		printf("accept %.*s\n", (int)(outlen - start - 1), outbuf + start);
+		fflush(stdout);
+		outlen = start;
+	} else if (!outbuffered) {
+		fwrite(outbuf + start, 1, outlen - start, stdout);
+		fflush(stdout);
+		outlen = start;
 	}
-	die("cannot grab keyboard");
 }
 
+struct sortpart {
+	unsigned int *v;
+	size_t n;
+	int (*cmp)(const void *, const void *);
+};
+
+static void *
+sortpart(void *arg)
+{
+	struct sortpart *p = arg;
+
+	qsort(p->v, p->n, sizeof *p->v, p->cmp);
+	return NULL;
+}
+
+/* sort v[0..n) by cmp, in parallel parts merged pairwise through tmp when
+ * it is large */
+static void
+sortrange(unsigned int *v, size_t n, unsigned int *tmp,
+          int (*cmp)(const void *, const void *))
+{
+	pthread_t th[SORTTHREADS];
+	struct sortpart part[SORTTHREADS];
+	unsigned int *src = v, *dst = tmp, *t;
+	size_t i, j, a, b, m, e, w, nparts;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	nparts = MIN(MAX(ncpu, 1), SORTTHREADS);
+	if (n < SORTPARALLEL || nparts < 2) {
+		qsort(v, n, sizeof *v, cmp);
+		return;
+	}
+	for (i = 0; i < nparts; i++) {
+		part[i].v = v + n * i / nparts;
+		part[i].n = n * (i + 1) / nparts - n * i / nparts;
+		part[i].cmp = cmp;
+		if (pthread_create(&th[i], NULL, sortpart, &part[i]))
+			sortpart(&part[i]), th[i] = 0;
+	}
+	for (i = 0; i < nparts; i++)
+		if (th[i])
+			pthread_join(th[i], NULL);
+	/* merge runs of width w, doubling it, between v and tmp */
+	for (w = 1; w < nparts; w *= 2) {
+		for (i = 0; i < nparts; i += 2 * w) {
+			a = n * i / nparts;
+			b = m = n * MIN(i + w, nparts) / nparts;
+			e = n * MIN(i + 2 * w, nparts) / nparts;
+			for (j = a; j < e; j++)
+				dst[j] = (a < m && (b == e || cmp(&src[a], &src[b]) < 0))
+				         ? src[a++] : src[b++];
+		}
+		t = src, src = dst, dst = t;
+	}
+	if (src != v)
+		memcpy(v, src, n * sizeof *v);
+}
+
+/* merge the input ordered runs v[0..a), v[a..b) and v[b..n) into out */
+static void
+merge3(unsigned int *v, size_t a, size_t b, size_t n, unsigned int *out)
+{
+	size_t i = 0, j = a, k = b;
+
+	while (i < a || j < b || k < n) {
+		if (i < a && (j >= b || v[i] < v[j]) && (k >= n || v[i] < v[k]))
+			*out++ = v[i++];
+		else if (j < b && (k >= n || v[j] < v[k]))
+			*out++ = v[j++];
+		else
+			*out++ = v[k++];
+	}
+}
+
+static void
+growmatches(void)
+{
+	if (nitems <= matchsize)
+		return;
+	matchsize = MAX(nitems, 2 * matchsize);
+	if (!(matches = realloc(matches, matchsize * sizeof *matches)) ||
+	    !(rest = realloc(rest, matchsize * sizeof *rest)) ||
+	    !(prevv = realloc(prevv, matchsize * sizeof *prevv)) ||
+	    (sortby && !(order = realloc(order, matchsize * sizeof *order))) ||
+	    (sortby && !(sortkey = realloc(sortkey, matchsize * sizeof *sortkey))))
+		die("cannot realloc %zu bytes:", matchsize * sizeof *rest);
+	nallocs += sortby ? 5 : 3;
+}
+
+/* run of item for the last matched query: 0 exact, 1 prefix, 2 substring,
+ * -1 if it does not match; with incr only dirty tokens are tested */
+static int
+classify(struct item *item, int incr)
+{
+	size_t i;
+	char *key;
+
+	if (item->flags & ItemRemoved)
+		return -1;
+	if (regexed)
+		return rematch(item) ? 0 : -1;
+	for (i = 0; i < tokc; i++)
+		if ((!incr || tokv[i].dirty) && !fieldstr(item, tokv[i].fold))
+			return -1;
+	key = fieldkey(item);
+	if (!tokc || !fstrncmp(query, key, querylen))
+		return 0;
+	if (!fstrncmp(tokv[0].fold, key, strlen(tokv[0].fold)))
+		return 1;
+	return 2;
+}
+
+static int
+keycmp(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+	int r;
+
+	if ((r = (fstrncmp == strncmp ? strcmp : strcasecmp)(
+	         fieldkey(&items[x]), fieldkey(&items[y]))))
+		return r;
+	return (x > y) - (x < y);
+}
+
+/* the items before n sorted by their folded key, so that those whose key
+ * starts with a token are a range of it */
+static unsigned int *
+keysort(size_t n)
+{
+	unsigned int *v, *tmp;
+	size_t i;
+
+	v = ecalloc(n ? n : 1, sizeof *v);
+	for (i = 0; i < n; i++)
+		v[i] = i;
+	tmp = ecalloc(n ? n : 1, sizeof *tmp);
+	sortrange(v, n, tmp, keycmp);
+	free(tmp);
+	return v;
+}
+
+static void
+keyindex(void)
+{
+	storefree(keyidx);
+	keyidx = keysort(nitems);
+	nkeyed = keyidxsize = nitems;
+}
+
+static void *
+keythread(void *arg)
+{
+	keybuild.v = keysort(keybuild.n);
+	__atomic_store_n(&keybuild.done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* sort the index on its own thread; the items must not change until it is
+ * adopted, so whatever changes them waits for it with keyadopt(1) */
+static void
+keystart(void)
+{
+	if (keybuild.running)
+		return;
+	keybuild.n = nitems;
+	keybuild.done = 0;
+	if ((errno = pthread_create(&keybuild.thread, NULL, keythread, NULL)))
+		die("pthread_create:");
+	keybuild.running = 1;
+}
+
+/* replace the index with the one built on its thread once that is done,
+ * or after waiting for it */
+static void
+keyadopt(int wait)
+{
+	if (!keybuild.running ||
+	    (!wait && !__atomic_load_n(&keybuild.done, __ATOMIC_ACQUIRE)))
+		return;
+	if ((errno = pthread_join(keybuild.thread, NULL)))
+		die("pthread_join:");
+	keybuild.running = 0;
+	storefree(keyidx);
+	keyidx = keybuild.v;
+	nkeyed = keyidxsize = keybuild.n;
+}
+
+/* range [*lo, *hi) of the index whose keys start with s */
+static void
+keyrange(const char *s, size_t *lo, size_t *hi)
+{
+	size_t a, b, mid, len = strlen(s);
+	int bound;
+
+	for (bound = 0; bound < 2; bound++) {
+		for (a = 0, b = nkeyed; a < b; ) {
+			mid = a + (b - a) / 2;
+			if (fstrncmp(fieldkey(&items[keyidx[mid]]), s, len) < bound)
+				a = mid + 1;
+			else
+				b = mid;
+		}
+		*(bound ? hi : lo) = a;
+	}
+}
+
+/* whether the input is one token whose prefix run can be looked up */
+static int
+keyquery(void)
+{
+	return nkeyed && !regexed && tokc == 1 && tokv[0].len == textlen;
+}
+
+/* offset in s of the byte at off of its case folded copy */
+static unsigned int
+unfoldoff(const char *s, unsigned int off)
+{
+	char rune[5], fold[FOLDSIZE(4)];
+	const char *p;
+	unsigned int n = 0, len;
+
+	for (p = s; *p && n < off; p += len) {
+		for (len = 1; len < 4 && (p[len] & 0xc0) == 0x80; len++)
+			;
+		memcpy(rune, p, len);
+		rune[len] = '\0';
+		utf8fold(fold, rune);
+		n += strlen(fold);
+	}
+	return p - s;
+}
+
+/* spans of the displayed field of item that the last query matched, as
+ * sorted and merged pairs of start and end offsets; returns their number */
+static unsigned int
+matchspans(struct item *item, unsigned int *spans)
+{
+	regmatch_t m;
+	regex_t *r;
+	unsigned int i, j, n = 0, a, b;
+	char *field, *p;
+
+	if (dispfield >= item->nfields || !(matchfields >> dispfield & 1))
+		return 0;
+	field = FIELD(item, dispfield);
+	if (regexed) {
+		if (!(r = subre()) || regexec(r, field, 1, &m, 0) || m.rm_so == m.rm_eo)
+			return 0;
+		spans[0] = m.rm_so;
+		spans[1] = m.rm_eo;
+		return 1;
+	}
+	for (i = 0; i < tokc && n < MAXSPANS; i++) {
+		if (!(p = fstrstr(FOLDFIELD(item, dispfield), tokv[i].fold)))
+			continue;
+		a = p - FOLDFIELD(item, dispfield);
+		b = a + strlen(tokv[i].fold);
+		if (item->flags & ItemFolded) {
+			a = unfoldoff(field, a);
+			b = unfoldoff(field, b);
+		}
+		/* insert in order of the starts */
+		for (j = n++; j > 0 && spans[2 * j - 2] > a; j--) {
+			spans[2 * j] = spans[2 * j - 2];
+			spans[2 * j + 1] = spans[2 * j - 1];
+		}
+		spans[2 * j] = a;
+		spans[2 * j + 1] = b;
+	}
+	/* merge overlapping spans */
+	for (i = j = 0; i < n; i++) {
+		if (j && spans[2 * i] <= spans[2 * j - 1]) {
+			spans[2 * j - 1] = MAX(spans[2 * j - 1], spans[2 * i + 1]);
+		} else {
+			spans[2 * j] = spans[2 * i];
+			spans[2 * j + 1] = spans[2 * i + 1];
+			j++;
+		}
+	}
+	return j;
+}
+
+/* record the spans of the shown items once per change of the matches,
+ * the frames drawn until the next one reuse them */
+static void
+pagespans(void)
+{
+	struct spans *s;
+	size_t i, n = next - curr;
+
+	if (n > pagehlsize) {
+		if (!(pagehl = realloc(pagehl, n * sizeof *pagehl)))
+			die("cannot realloc %zu bytes:", n * sizeof *pagehl);
+		memset(pagehl + pagehlsize, 0, (n - pagehlsize) * sizeof *pagehl);
+		pagehlsize = n;
+	}
+	for (i = curr; i < next; i++) {
+		s = &pagehl[i - curr];
+		if (s->gen == matchgen && s->item == (unsigned int)(MATCH(i) - items))
+			continue;
+		s->gen = matchgen;
+		s->item = MATCH(i) - items;
+		s->n = matchspans(MATCH(i), s->v);
+	}
+}
+
+static void
+match(void)
+{
+	static char *fold = NULL;
+	static size_t foldsize = 0;
+
+	size_t i, n, nprefix, nsubstr, lo = 0, hi = 0;
+	unsigned int *v, k;
+	int incr = refine, keyed, r;
+
+	refine = regexed = 0;
+	/* items are compared with their folded copies */
+	query = text;
+	if (fstrstr == cistrstr) {
+		if (FOLDSIZE(textlen) > foldsize) {
+			foldsize = FOLDSIZE(textlen);
+			if (!(fold = realloc(fold, foldsize)))
+				die("cannot realloc %zu bytes:", foldsize);
+		}
+		utf8fold(fold, text);
+		query = fold;
+	}
+	querylen = strlen(query) + 1;
+	growmatches();
+	if (useregex && textlen && recompile()) {
+		regexed = 1;
+		incr = 0;
+	}
+	/* refined or added tokens can only narrow the previous matches, so
+	 * only those are tested against them, in input order */
+	if (incr) {
+		v = prevv;
+		prevv = matches;
+		matches = v;
+		merge3(prevv, nexact, nexact + nprefixed, nmatches, matches);
+		n = nmatches;
+	} else
+		n = nitems;
+
+	/* a finished index replaces the old one, which is sorted again in the
+	 * background once it lags far behind the items; items beyond it are
+	 * scanned meanwhile */
+	keyadopt(0);
+	if (!incr && nitems - nkeyed > nkeyed / 2)
+		keystart();
+	/* indexed items whose key starts with the only token are marked, the
+	 * others can only be substring matches */
+	if ((keyed = keyquery())) {
+		keyrange(tokv[0].fold, &lo, &hi);
+		for (i = lo; i < hi; i++)
+			MARK(keymarks, keyidx[i]);
+	}
+
+	/* prefixes fill rest from the front, substrings from the back */
+	nmatches = nprefix = nsubstr = 0;
+	for (v = incr ? matches : NULL; n--; ) {
+		k = v ? *v++ : nitems - n - 1;
+		if (!keyed || k >= nkeyed)
+			r = classify(&items[k], incr);
+		else if (MARKED(keymarks, k))
+			r = (items[k].flags & ItemRemoved) ? -1 :
+			    !fstrncmp(query, fieldkey(&items[k]), querylen) ? 0 : 1;
+		else
+			r = (items[k].flags & ItemRemoved) ||
+			    !fieldstr(&items[k], tokv[0].fold) ? -1 : 2;
+		switch (r) {
+		case 0: matches[nmatches++] = k;          break;
+		case 1: rest[nprefix++] = k;              break;
+		case 2: rest[matchsize - ++nsubstr] = k;  break;
+		}
+	}
+	for (i = lo; i < hi; i++)
+		UNMARK(keymarks, keyidx[i]);
+	nexact = nmatches;
+	nprefixed = nprefix;
+	if (nprefix)
+		memcpy(matches + nmatches, rest, nprefix * sizeof *rest);
+	nmatches += nprefix;
+	/* substrings were stored in reverse */
+	for (i = 1; i <= nsubstr; i++)
+		matches[nmatches++] = rest[matchsize - i];
+	for (i = 0; i < tokc; i++)
+		tokv[i].dirty = 0;
+	refine = !regexed;
+	orderdirty = 1;
+	matchgen++;
+	curr = sel = 0;
+	npages = 0; /* the page index belongs to the old match set */
+	calcoffsets();
+	matchdirty = 0;
+}
+
+/* position of item in the matches, or -1 */
+static ssize_t
+matchpos(struct item *item)
+{
+	size_t bound[4] = { 0, nexact, nexact + nprefixed, nmatches };
+	size_t a, b, mid, k = item - items;
+	int r;
+
+	/* each run is in input order */
+	for (r = 0; r < 3; r++) {
+		for (a = bound[r], b = bound[r + 1]; a < b; ) {
+			mid = a + (b - a) / 2;
+			if (matches[mid] < k)
+				a = mid + 1;
+			else
+				b = mid;
+		}
+		if (a < bound[r + 1] && matches[a] == k)
+			return a;
+	}
+	return -1;
+}
+
+static void
+unmatch(struct item *item)
+{
+	ssize_t i;
+
+	if ((i = matchpos(item)) < 0)
+		return;
+	if ((size_t)i < nexact)
+		nexact--;
+	else if ((size_t)i < nexact + nprefixed)
+		nprefixed--;
+	memmove(&matches[i], &matches[i + 1], (nmatches - i - 1) * sizeof *matches);
+	nmatches--;
+	orderdirty = 1;
+	matchgen++;
+}
+
+/* insert item into its run of the matches, if it matches */
+static void
+matchinsert(struct item *item)
+{
+	size_t a, b, mid, k = item - items;
+
+	switch (classify(item, 0)) {
+	case -1: return;
+	case 0:  a = 0, b = nexact++;                          break;
+	case 1:  a = nexact, b = nexact + nprefixed++;         break;
+	default: a = nexact + nprefixed, b = nmatches;         break;
+	}
+	while (a < b) {
+		mid = a + (b - a) / 2;
+		if (matches[mid] < k)
+			a = mid + 1;
+		else
+			b = mid;
+	}
+	memmove(&matches[a + 1], &matches[a], (nmatches - a) * sizeof *matches);
+	matches[a] = k;
+	nmatches++;
+	orderdirty = 1;
+	matchgen++;
+}
+
+/* add the items from index from on to the matches of the last query */
+static void
+matchnew(size_t from)
+{
+	size_t i, s, ne = 0, np = 0, ns = 0;
+
+	if (from == nitems)
+		return;
+	growmatches();
+	for (i = from; i < nitems; i++) {
+		switch (classify(&items[i], 0)) {
+		case 0: prevv[ne++] = i;             break;
+		case 1: rest[np++] = i;              break;
+		case 2: rest[matchsize - ++ns] = i;  break;
+		}
+	}
+	/* new items go last in each run */
+	s = nexact + nprefixed;
+	memmove(&matches[s + ne + np], &matches[s], (nmatches - s) * sizeof *matches);
+	memmove(&matches[nexact + ne], &matches[nexact], nprefixed * sizeof *matches);
+	memcpy(&matches[nexact], prevv, ne * sizeof *matches);
+	memcpy(&matches[nexact + ne + nprefixed], rest, np * sizeof *matches);
+	nexact += ne;
+	nprefixed += np;
+	nmatches += ne + np;
+	for (i = 1; i <= ns; i++)
+		matches[nmatches++] = rest[matchsize - i];
+	orderdirty = 1;
+	matchgen++;
+}
+
+/* offset of the first token in the first matched field that contains it,
+ * the regex offsets are kept by rematch() */
+static unsigned int
+matchoffset(struct item *item)
+{
+	unsigned int k;
+	char *p;
+
+	for (k = 0; k < item->nfields; k++) {
+		if (!(matchfields >> k & 1))
+			continue;
+		if (!tokc) {
+			return 0;
+		} else if ((p = fstrstr(FOLDFIELD(item, k), tokv[0].fold))) {
+			return p - FOLDFIELD(item, k);
+		}
+	}
+	return 0;
+}
+
+/* compare two matches by sortby, ties in input order */
+static int
+ordercmp(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+	int r;
+
+	if (sortby == SortAlpha) {
+		if ((r = (fstrncmp == strncmp ? strcmp : strcasecmp)(
+		         itemtext(&items[x]), itemtext(&items[y]))))
+			return r;
+	} else if (sortkey[x] != sortkey[y]) {
+		return sortkey[x] < sortkey[y] ? -1 : 1;
+	}
+	return (x > y) - (x < y);
+}
+
+/* move the k first of v[0..n) in order to its front, in any order */
+static void
+selectfirst(unsigned int *v, size_t n, size_t k)
+{
+	ssize_t i, j;
+	unsigned int p, t;
+
+	while (k > 0 && k < n) {
+		p = v[(n - 1) / 2];
+		for (i = -1, j = n; ; ) {
+			while (ordercmp(&v[++i], &p) < 0)
+				;
+			while (ordercmp(&v[--j], &p) > 0)
+				;
+			if (i >= j)
+				break;
+			t = v[i], v[i] = v[j], v[j] = t;
+		}
+		/* v[0..j] come before v[j+1..n) */
+		if (k <= (size_t)j + 1) {
+			n = j + 1;
+		} else {
+			v += j + 1;
+			n -= j + 1;
+			k -= j + 1;
+		}
+	}
+}
+
+/* set the sort keys of order up to n, a run at a time */
+static void
+sortkeys(size_t n)
+{
+	unsigned int k;
+
+	if (sortby == SortAlpha || (sortby == SortPosition && regexed))
+		nkeyorder = MAX(nkeyorder, n);
+	for (; nkeyorder < n; nkeyorder++) {
+		k = order[nkeyorder];
+		sortkey[k] = sortby == SortLength ? strlen(itemtext(&items[k]))
+		                                  : matchoffset(&items[k]);
+	}
+}
+
+/* the match at i in display order; the runs are keyed and sorted lazily,
+ * up to the page after the one asked for */
+static unsigned int
+ordered(size_t i)
+{
+	size_t j, want, run;
+
+	if (orderdirty) {
+		memcpy(order, matches, nmatches * sizeof *order);
+		nordered = nkeyorder = 0;
+		orderdirty = 0;
+	}
+	want = MIN(nmatches, i + 2 * (lines > 0 ? lines : 32));
+	while (nordered < want) {
+		run = nordered < nexact ? nexact :
+		      nordered < nexact + nprefixed ? nexact + nprefixed : nmatches;
+		j = MIN(run, want);
+		sortkeys(run); /* the selection compares the whole run */
+		selectfirst(order + nordered, run - nordered, j - nordered);
+		sortrange(order + nordered, j - nordered, rest, ordercmp);
+		nordered = j;
+	}
+	return order[i];
+}
+
+/* display position of the match at i in matches */
+static size_t
+orderpos(size_t i)
+{
+	size_t a, b, r;
+	unsigned int k = matches[i];
+
+	a = i < nexact ? 0 : i < nexact + nprefixed ? nexact : nexact + nprefixed;
+	b = i < nexact ? nexact : i < nexact + nprefixed ? nexact + nprefixed : nmatches;
+	ordered(a);
+	sortkeys(b);
+	for (r = a; a < b; a++)
+		if (ordercmp(&matches[a], &k) < 0)
+			r++;
+	return r;
+}
+
+/* keep item s selected, if it still matches, after the matches changed */
+static void
+reselect(struct item *s)
+{
+	ssize_t i;
+
+	if (s && (i = matchpos(s)) >= 0)
+		sel = sortby ? orderpos(i) : (size_t)i;
+	else
+		sel = MIN(sel, nmatches ? nmatches - 1 : 0);
+	curr = MIN(curr, sel);
+	npages = 0;
+	calcoffsets();
+	if (sel >= next) {
+		curr = lines > 0 ? sel - lines + 1 : sel;
+		calcoffsets();
+	}
+	dirty = 1;
+}
+
+/* apply pending edits of the input text to the match list */
+static void
+flushmatch(void)
+{
+	if (matchdirty)
+		match();
+}
+
+static char *
+foldtoken(const char *s, size_t len)
+{
+	char *raw, *fold;
+
+	if (!(raw = strndup(s, len)))
+		die("cannot strndup %zu bytes:", len + 1);
+	if (fstrstr != cistrstr)
+		return raw;
+	fold = ecalloc(1, FOLDSIZE(len));
+	utf8fold(fold, raw);
+	free(raw);
+	return fold;
+}
+
+/* replace len bytes of the input at pos by n bytes of str, and scan the
+ * tokens touching the edit again */
 static void
-match(void)
+textedit(size_t pos, size_t len, const char *str, size_t n)
 {
-	static char **tokv = NULL;
-	static int tokn = 0;
-
-	char buf[sizeof text], *s;
-	int i, tokc = 0;
-	size_t len, textsize;
-	struct item *item, *lprefix, *lsubstr, *prefixend, *substrend;
-
-	strcpy(buf, text);
-	/* separate input text into tokens to be matched individually */
-	for (s = strtok(buf, " "); s; tokv[tokc - 1] = s, s = strtok(NULL, " "))
-		if (++tokc > tokn && !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
-			die("cannot realloc %zu bytes:", tokn * sizeof *tokv);
-	len = tokc ? strlen(tokv[0]) : 0;
-
-	matches = lprefix = lsubstr = matchend = prefixend = substrend = NULL;
-	textsize = strlen(text) + 1;
-	for (item = items; item && item->text; item++) {
-		for (i = 0; i < tokc; i++)
-			if (!fstrstr(item->text, tokv[i]))
+	struct token *old;
+	size_t first, last, nold, nnew, start, end, i, j;
+	ssize_t delta = (ssize_t)n - (ssize_t)len;
+
+	if (textlen + delta + 1 > textsize) {
+		textsize = MAX(2 * textsize, textlen + delta + 1);
+		if (!(text = realloc(text, textsize)))
+			die("cannot realloc %zu bytes:", textsize);
+	}
+	memmove(&text[pos + n], &text[pos + len], textlen - pos - len + 1);
+	if (n > 0 && str != NULL)
+		memcpy(&text[pos], str, n);
+	textlen += delta;
+	matchdirty = 1;
+	querychanged = 1;
+
+	for (first = 0; first < tokc && tokv[first].off + tokv[first].len < pos; first++)
+		;
+	for (last = first; last < tokc && tokv[last].off <= pos + len; last++)
+		;
+	nold = last - first;
+	start = end = pos;
+	if (nold) {
+		start = MIN(pos, tokv[first].off);
+		end = tokv[last - 1].off + tokv[last - 1].len;
+		end = end >= pos + len ? end + delta : pos;
+	}
+	end = MAX(end, pos + n);
+	for (i = start, nnew = 0; i < end; nnew++) {
+		while (i < end && text[i] == ' ')
+			i++;
+		if (i == end)
+			break;
+		while (i < end && text[i] != ' ')
+			i++;
+	}
+
+	/* splice the tokens of [start, end) in place of the old ones */
+	old = ecalloc(nold + 1, sizeof *old);
+	if (nold)
+		memcpy(old, &tokv[first], nold * sizeof *old);
+	if (tokc - nold + nnew > toksize) {
+		toksize = MAX(2 * toksize, tokc - nold + nnew);
+		if (!(tokv = realloc(tokv, toksize * sizeof *tokv)))
+			die("cannot realloc %zu bytes:", toksize * sizeof *tokv);
+	}
+	memmove(&tokv[first + nnew], &tokv[last], (tokc - last) * sizeof *tokv);
+	tokc = tokc - nold + nnew;
+	for (i = first + nnew; i < tokc; i++)
+		tokv[i].off += delta;
+	for (i = start, j = first; j < first + nnew; j++) {
+		while (text[i] == ' ')
+			i++;
+		tokv[j].off = i;
+		while (i < end && text[i] != ' ')
+			i++;
+		tokv[j].len = i - tokv[j].off;
+		tokv[j].fold = foldtoken(&text[tokv[j].off], tokv[j].len);
+		tokv[j].dirty = 1;
+	}
+
+	/* the edit refines the query if each old token is part of a new one */
+	for (i = 0; i < nold; i++) {
+		for (j = first; j < first + nnew; j++)
+			if (strstr(tokv[j].fold, old[i].fold))
 				break;
-		if (i != tokc) /* not all tokens match */
-			continue;
-		/* exact matches go first, then prefixes, then substrings */
-		if (!tokc || !fstrncmp(text, item->text, textsize))
-			appenditem(item, &matches, &matchend);
-		else if (!fstrncmp(tokv[0], item->text, len))
-			appenditem(item, &lprefix, &prefixend);
-		else
-			appenditem(item, &lsubstr, &substrend);
-	}
-	if (lprefix) {
-		if (matches) {
-			matchend->right = lprefix;
-			lprefix->left = matchend;
-		} else
-			matches = lprefix;
-		matchend = prefixend;
-	}
-	if (lsubstr) {
-		if (matches) {
-			matchend->right = lsubstr;
-			lsubstr->left = matchend;
-		} else
-			matches = lsubstr;
-		matchend = substrend;
-	}
-	curr = sel = matches;
-	calcoffsets();
+		if (j == first + nnew)
+			refine = 0;
+		free(old[i].fold);
+	}
+	free(old);
 }
 
 static void
 insert(const char *str, ssize_t n)
 {
-	if (strlen(text) + n > sizeof text - 1)
-		return;
-	/* move existing text out of the way, insert new text, and update cursor */
-	memmove(&text[cursor + n], &text[cursor], sizeof text - cursor - MAX(n, 0));
-	if (n > 0 && str != NULL)
-		memcpy(&text[cursor], str, n);
+	if (n >= 0)
+		textedit(cursor, 0, str, n);
+	else
+		textedit(cursor + n, -n, NULL, 0);
 	cursor += n;
-	match();
 }
 
 static size_t
@@ -370,6 +1734,65 @@ nextrune(int inc)
 	return n;
 }
 
+/* length of the common prefix of the keys a and b, at a rune boundary */
+static size_t
+keylcp(const char *a, const char *b)
+{
+	size_t n;
+
+	for (n = 0; a[n] && (a[n] == b[n] || (fstrncmp == strncasecmp &&
+	     tolower((unsigned char)a[n]) == tolower((unsigned char)b[n]))); n++)
+		;
+	while (n && (a[n] & 0xc0) == 0x80)
+		n--;
+	return n;
+}
+
+/* complete the input to the longest common prefix of the keys it is a
+ * prefix of, like a shell; returns 0 if that would not extend it */
+static int
+complete(void)
+{
+	struct item *first = NULL;
+	size_t lo = 0, hi = 0, i, n = 0, toklen;
+	unsigned int k;
+	char *key;
+
+	if (regexed || tokc != 1 || tokv[0].len != textlen || !(nexact + nprefixed))
+		return 0;
+	toklen = strlen(tokv[0].fold);
+	keyadopt(0);
+	/* the keys of the range are sorted: its first and last share the
+	 * prefix of all of them */
+	if (nkeyed)
+		keyrange(tokv[0].fold, &lo, &hi);
+	for (; lo < hi && (items[keyidx[lo]].flags & ItemRemoved); lo++)
+		;
+	for (; hi > lo && (items[keyidx[hi - 1]].flags & ItemRemoved); hi--)
+		;
+	if (lo < hi) {
+		first = &items[keyidx[lo]];
+		n = keylcp(fieldkey(first), fieldkey(&items[keyidx[hi - 1]]));
+	}
+	for (i = nkeyed; i < nitems; i++) {
+		key = fieldkey(&items[i]);
+		if ((items[i].flags & ItemRemoved) || fstrncmp(key, tokv[0].fold, toklen))
+			continue;
+		if (!first)
+			n = strlen(key), first = &items[i];
+		else
+			n = MIN(n, keylcp(fieldkey(first), key));
+	}
+	if (!first || n <= toklen)
+		return 0;
+	for (k = 0; !(matchfields >> k & 1); k++)
+		;
+	if (first->flags & ItemFolded)
+		n = unfoldoff(FIELD(first, k), n);
+	textedit(0, textlen, FIELD(first, k), n);
+	return 1;
+}
+
 static void
 movewordedge(int dir)
 {
@@ -390,7 +1813,8 @@ static void
 keypress(XKeyEvent *ev)
 {
 	char buf[64];
-	int len;
+	int i, n, len;
+	size_t end;
 	KeySym ksym = NoSymbol;
 	Status status;
 
@@ -424,17 +1848,19 @@ keypress(XKeyEvent *ev)
 		case XK_p: ksym = XK_Up;        break;
 
 		case XK_k: /* delete right */
-			text[cursor] = '\0';
-			match();
+			textedit(cursor, textlen - cursor, NULL, 0);
 			break;
 		case XK_u: /* delete left */
 			insert(NULL, 0 - cursor);
 			break;
 		case XK_w: /* delete word */
+			end = cursor;
 			while (cursor > 0 && strchr(worddelimiters, text[nextrune(-1)]))
-				insert(NULL, nextrune(-1) - cursor);
+				cursor = nextrune(-1);
 			while (cursor > 0 && !strchr(worddelimiters, text[nextrune(-1)]))
-				insert(NULL, nextrune(-1) - cursor);
+				cursor = nextrune(-1);
+			/* the whole word goes in one edit */
+			textedit(cursor, end - cursor, NULL, 0);
 			break;
 		case XK_v: /* paste selection */
 		case XK_V:
@@ -496,36 +1922,41 @@ insert:
 		break;
 	case XK_End:
 	case XK_KP_End:
+		flushmatch();
 		if (text[cursor] != '\0') {
-			cursor = strlen(text);
+			cursor = textlen;
 			break;
 		}
-		if (next) {
-			/* jump to end of list and position items in reverse */
-			curr = matchend;
-			calcoffsets();
-			curr = prev;
+		if (next < nmatches) {
+			/* fill the last page backwards from the last item */
+			if (lines > 0)
+				curr = nmatches - lines;
+			else
+				for (i = 0, curr = nmatches, n = pagewidth(); curr > 0; curr--)
+					if ((i += textw_clamp(itemtext(MATCH(curr - 1)), n)) > n)
+						break;
 			calcoffsets();
-			while (next && (curr = curr->right))
-				calcoffsets();
 		}
-		sel = matchend;
+		if (nmatches)
+			sel = nmatches - 1;
 		break;
 	case XK_Escape:
 		cleanup();
 		exit(1);
 	case XK_Home:
 	case XK_KP_Home:
-		if (sel == matches) {
+		flushmatch();
+		if (sel == 0) {
 			cursor = 0;
 			break;
 		}
-		sel = curr = matches;
+		sel = curr = 0;
 		calcoffsets();
 		break;
 	case XK_Left:
 	case XK_KP_Left:
-		if (cursor > 0 && (!sel || !sel->left || lines > 0)) {
+		flushmatch();
+		if (cursor > 0 && (sel == 0 || lines > 0)) {
 			cursor = nextrune(-1);
 			break;
 		}
@@ -534,37 +1965,42 @@ insert:
 		/* fallthrough */
 	case XK_Up:
 	case XK_KP_Up:
-		if (sel && sel->left && (sel = sel->left)->right == curr) {
+		flushmatch();
+		if (sel > 0 && --sel < curr) {
 			curr = prev;
 			calcoffsets();
 		}
 		break;
 	case XK_Next:
 	case XK_KP_Next:
-		if (!next)
+		flushmatch();
+		if (next >= nmatches)
 			return;
 		sel = curr = next;
 		calcoffsets();
 		break;
 	case XK_Prior:
 	case XK_KP_Prior:
-		if (!prev)
+		flushmatch();
+		if (!nmatches)
 			return;
 		sel = curr = prev;
 		calcoffsets();
 		break;
 	case XK_Return:
 	case XK_KP_Enter:
-		puts((sel && !(ev->state & ShiftMask)) ? getitemval(sel): text);
+		flushmatch();
+		output((nmatches && !(ev->state & ShiftMask)) ? MATCH(sel) : NULL);
 		if (!(ev->state & ControlMask)) {
 			cleanup();
 			exit(0);
 		}
-		if (sel)
-			sel->out = 1;
+		if (nmatches)
+			MARK(outmarks, MATCH(sel) - items);
 		break;
 	case XK_Right:
 	case XK_KP_Right:
+		flushmatch();
 		if (text[cursor] != '\0') {
 			cursor = nextrune(+1);
 			break;
@@ -574,34 +2010,36 @@ insert:
 		/* fallthrough */
 	case XK_Down:
 	case XK_KP_Down:
-		if (sel && sel->right && (sel = sel->right) == next) {
+		flushmatch();
+		if (sel + 1 < nmatches && ++sel == next) {
 			curr = next;
 			calcoffsets();
 		}
 		break;
 	case XK_Tab:
-		if (!sel)
+		flushmatch();
+		if (!nmatches)
 			return;
-		cursor = strnlen(sel->text, sizeof text - 1);
-		memcpy(text, sel->text, cursor);
-		text[cursor] = '\0';
-		match();
+		if (!complete())
+			textedit(0, textlen, itemtext(MATCH(sel)), strlen(itemtext(MATCH(sel))));
+		cursor = textlen;
 		break;
 	}
 
 draw:
-	drawmenu();
+	dirty = 1;
 }
 
 static void
 buttonpress(XEvent *e)
 {
-	struct item *item;
+	size_t i;
 	XButtonPressedEvent *ev = &e->xbutton;
 	int x = 0, y = 0, h = bh, w;
 
 	if (ev->window != win)
 		return;
+	flushmatch();
 
 	/* right-click: exit */
 	if (ev->button == Button3) {
@@ -613,38 +2051,38 @@ buttonpress(XEvent *e)
 		x += promptw;
 
 	/* input field */
-	w = (lines > 0 || !matches) ? mw - x : inputw;
+	w = (lines > 0 || !nmatches) ? mw - x : inputw;
 
 	/* left-click on input: clear input,
 	 * NOTE: if there is no left-arrow the space for < is reserved so
 	 *       add that to the input width */
 	if (ev->button == Button1 &&
 	   ((lines <= 0 && ev->x >= 0 && ev->x <= x + w +
-	   ((!prev || !curr->left) ? TEXTW("<") : 0)) ||
+	   ((!nmatches || curr == 0) ? TEXTW("<") : 0)) ||
 	   (lines > 0 && ev->y >= y && ev->y <= y + h))) {
 		insert(NULL, -cursor);
-		drawmenu();
+		dirty = 1;
 		return;
 	}
 	/* middle-mouse click: paste selection */
 	if (ev->button == Button2) {
 		XConvertSelection(dpy, (ev->state & ShiftMask) ? clip : XA_PRIMARY,
 		                  utf8, utf8, win, CurrentTime);
-		drawmenu();
+		dirty = 1;
 		return;
 	}
 	/* scroll up */
-	if (ev->button == Button4 && prev) {
+	if (ev->button == Button4 && nmatches) {
 		sel = curr = prev;
 		calcoffsets();
-		drawmenu();
+		dirty = 1;
 		return;
 	}
 	/* scroll down */
-	if (ev->button == Button5 && next) {
+	if (ev->button == Button5 && next < nmatches) {
 		sel = curr = next;
 		calcoffsets();
-		drawmenu();
+		dirty = 1;
 		return;
 	}
 	if (ev->button != Button1)
@@ -654,59 +2092,55 @@ buttonpress(XEvent *e)
 	if (lines > 0) {
 		/* vertical list: (ctrl)left-click on item */
 		w = mw - x;
-		for (item = curr; item != next; item = item->right) {
+		for (i = curr; i < next; i++) {
 			y += h;
 			if (ev->y >= y && ev->y <= (y + h)) {
-				puts(item->text);
+				output(MATCH(i));
 				if (!(ev->state & ControlMask)) {
           cleanup();
 					exit(0);
         }
-				sel = item;
-				if (sel) {
-					sel->out = 1;
-					drawmenu();
-				}
+				sel = i;
+				MARK(outmarks, MATCH(sel) - items);
+				dirty = 1;
 				return;
 			}
 		}
-	} else if (matches) {
+	} else if (nmatches) {
 		/* left-click on left arrow */
 		x += inputw;
 		w = TEXTW("<");
-		if (prev && curr->left) {
+		if (curr > 0) {
 			if (ev->x >= x && ev->x <= x + w) {
 				sel = curr = prev;
 				calcoffsets();
-				drawmenu();
+				dirty = 1;
 				return;
 			}
 		}
 		/* horizontal list: (ctrl)left-click on item */
-		for (item = curr; item != next; item = item->right) {
+		for (i = curr; i < next; i++) {
 			x += w;
-			w = MIN(TEXTW(item->text), mw - x - TEXTW(">"));
+			w = MIN(TEXTW(itemtext(MATCH(i))), mw - x - TEXTW(">"));
 			if (ev->x >= x && ev->x <= x + w) {
-				puts(item->text);
+				output(MATCH(i));
 				if (!(ev->state & ControlMask)) {
           cleanup();
 					exit(0);
         }
-				sel = item;
-				if (sel) {
-					sel->out = 1;
-					drawmenu();
-				}
+				sel = i;
+				MARK(outmarks, MATCH(sel) - items);
+				dirty = 1;
 				return;
 			}
 		}
 		/* left-click on right arrow */
 		w = TEXTW(">");
 		x = mw - w;
-		if (next && ev->x >= x && ev->x <= x + w) {
+		if (next < nmatches && ev->x >= x && ev->x <= x + w) {
 			sel = curr = next;
 			calcoffsets();
-			drawmenu();
+			dirty = 1;
 			return;
 		}
 	}
@@ -721,53 +2155,410 @@ paste(void)
 	Atom da;
 
 	/* we have been given the current selection, now insert it into input */
-	if (XGetWindowProperty(dpy, win, utf8, 0, (sizeof text / 4) + 1, False,
+	if (XGetWindowProperty(dpy, win, utf8, 0, ~0L, False,
 	                   utf8, &da, &di, &dl, &dl, (unsigned char **)&p) == Success && p) {
 		insert(p, (q = strchr(p, '\n')) ? q - p : (ssize_t)strlen(p));
 		XFree(p);
 	}
-	drawmenu();
+	dirty = 1;
+}
+
+/* append an item for line */
+static void
+additem(char *line)
+{
+	if (nitems == itemsize) {
+		if (nitems == UINT_MAX)
+			die("too many items");
+		itemsize = itemsize ? MIN(2 * itemsize, UINT_MAX) : 256;
+		items = storegrow(items, nitems * sizeof *items, itemsize * sizeof *items);
+		growmarks(itemsize);
+	}
+	inputbytes += strlen(line) + 1;
+	inititem(&items[nitems++], line);
+}
+
+/* apply a line of followed input: an item, or ESC followed by a command,
+ * a space and a line whose first field selects the items to change:
+ * d removes them and r replaces them by the line, or appends it */
+static void
+followline(char *line, size_t *from)
+{
+	size_t i, len;
+	char *key = line + 3;
+	int found = 0;
+
+	if (line[0] != '\033') {
+		additem(line);
+		return;
+	}
+	if (!line[1] || !strchr("dr", line[1]) || line[2] != ' ')
+		return;
+	len = strcspn(key, "\t");
+	for (i = 0; i < nitems; i++) {
+		if ((items[i].flags & ItemRemoved) || strlen(FIELD(&items[i], 0)) != len ||
+		    strncmp(FIELD(&items[i], 0), key, len))
+			continue;
+		/* items from *from on are not matched yet */
+		if (i < *from && !matchdirty)
+			unmatch(&items[i]);
+		/* the old text stays in the arena */
+		items[i].flags |= ItemRemoved;
+		if (line[1] == 'r') {
+			if (i < nkeyed)
+				nkeyed = 0; /* its key changes, the index is stale */
+			UNMARK(outmarks, i);
+			inititem(&items[i], key);
+			if (i < *from && !matchdirty)
+				matchinsert(&items[i]);
+			found = 1;
+		}
+	}
+	if (line[1] == 'r' && !found)
+		additem(key);
+}
+
+/* apply a line of the protocol, see -c */
+static void
+command(char *line, size_t *from)
+{
+	char *arg;
+	long n;
+
+	if ((arg = strchr(line, ' ')))
+		*arg++ = '\0';
+	else
+		arg = strchr(line, '\0');
+
+	if (!strcmp(line, "add")) {
+		additem(arg);
+	} else if (!strcmp(line, "clear")) {
+		freeitems();
+		nmatches = nexact = nprefixed = nkeyed = 0;
+		orderdirty = 1;
+		matchgen++;
+		*from = 0;
+		keep = -1;
+	} else if (!strcmp(line, "prompt")) {
+		free(promptbuf);
+		if (!(prompt = promptbuf = strdup(arg)))
+			die("cannot strdup %zu bytes:", strlen(arg) + 1);
+		promptw = *prompt ? TEXTW(prompt) - lrpad / 4 : 0;
+		npages = 0;
+		dirty = 1;
+	} else if (!strcmp(line, "query")) {
+		textedit(0, textlen, arg, strlen(arg));
+		cursor = textlen;
+		querychanged = 0;
+		dirty = 1; /* the frame matches it, then the selection is reported */
+	} else if (!strcmp(line, "select")) {
+		/* the selection is among the matches of all items so far */
+		if (matchdirty)
+			flushmatch();
+		else
+			matchnew(*from);
+		*from = nitems;
+		if ((n = strtol(arg, NULL, 10)) >= 1 && (size_t)n <= nitems)
+			keep = n - 1;
+	}
+}
+
+/* tell the host about changes of the query and the selection */
+static void
+report(void)
+{
+	static ssize_t reported = -1;
+	ssize_t s = nmatches ? MATCH(sel) - items + 1 : 0;
+
+	if (querychanged)
+		printf("query %s\n", text);
+	if (s != reported)
+		printf("select %zd\n", s);
+	if (querychanged || s != reported)
+		fflush(stdout);
+	querychanged = 0;
+	reported = s;
+}
+
+/* wait for X events or followed input, and apply the complete lines that
+ * were read as one batch */
+static void
+follow(void)
+{
+	static char *buf = NULL;
+	static size_t len = 0, size = 0;
+	static int eof = 0;
+
+	struct pollfd fds[2];
+	size_t from = nitems;
+	ssize_t n;
+	char *p, *q;
+
+	fds[0].fd = ConnectionNumber(dpy);
+	fds[1].fd = followfd;
+	fds[0].events = fds[1].events = POLLIN;
+	/* at end of file, look for more input from time to time */
+	if (poll(fds, eof ? 1 : 2, eof ? 250 : -1) < 0 && errno != EINTR)
+		die("poll:");
+	if (eof ? fds[0].revents : !fds[1].revents)
+		return;
+
+	if (len + BUFSIZ > size) {
+		size = 2 * size + BUFSIZ;
+		if (!(buf = realloc(buf, size)))
+			die("cannot realloc %zu bytes:", size);
+	}
+	if ((n = read(followfd, buf + len, size - len)) < 0 &&
+	    errno != EAGAIN && errno != EINTR)
+		die("read:");
+	if ((eof = n == 0) || n < 0)
+		return;
+	len += n;
+	keyadopt(1); /* the lines change the items */
+	keep = nmatches ? MATCH(sel) - items : -1;
+	for (p = buf; (q = memchr(p, '\n', buf + len - p)); p = q + 1) {
+		*q = '\0';
+		(protocol ? command : followline)(p, &from);
+	}
+	memmove(buf, p, len -= p - buf);
+
+	/* a pending rematch covers the new items anyway */
+	if (matchdirty) {
+		refine = 0;
+		return;
+	}
+	matchnew(from);
+	reselect(keep >= 0 ? &items[keep] : NULL);
+}
+
+/* name of the shared memory segment of the corpus file, which also depends
+ * on what the item store derives from the text */
+static void
+corpusname(char *name, size_t size)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	char *path, *p;
+
+	if (!(path = realpath(corpusfile, NULL)))
+		die("realpath %s:", corpusfile);
+	for (p = path; *p; p++)
+		h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+	h = (h ^ (fstrstr == cistrstr)) * 1099511628211ULL;
+	h = (h ^ matchfields) * 1099511628211ULL;
+	free(path);
+	snprintf(name, size, "/dmenu-%u-%016llx", (unsigned int)getuid(), h);
+}
+
+/* nonzero if the array of n elements of size at off lies within the
+ * corpus c and is aligned for them */
+static int
+inbounds(const struct corpus *c, unsigned long long off, unsigned long long n,
+         size_t size)
+{
+	return off % size == 0 && off >= sizeof *c && off <= c->total &&
+	       n <= (c->total - off) / size;
+}
+
+/* check that every offset of the corpus c mapped at base stays within it */
+static int
+corpusvalid(const struct corpus *c, const char *base)
+{
+	const struct item *it = (const struct item *)(base + c->items);
+	const unsigned int *fv = (const unsigned int *)(base + c->fieldv);
+	const unsigned int *ki = (const unsigned int *)(base + c->keyidx);
+	unsigned long long i;
+
+	if (!inbounds(c, c->items, c->nitems, sizeof *it) ||
+	    !inbounds(c, c->fieldv, c->nfieldv, sizeof *fv) ||
+	    !inbounds(c, c->arena, c->arenalen, 1) ||
+	    !inbounds(c, c->keyidx, c->nkeyed, sizeof *ki) ||
+	    c->nitems > UINT_MAX || c->arenalen > UINT_MAX || c->nkeyed > c->nitems ||
+	    (c->arenalen && base[c->arena + c->arenalen - 1] != '\0'))
+		return 0;
+	for (i = 0; i < c->nitems; i++)
+		if (it[i].fields + (unsigned long long)it[i].nfields *
+		    (it[i].flags & ItemFolded ? 2 : 1) > c->nfieldv)
+			return 0;
+	for (i = 0; i < c->nfieldv; i++)
+		if (fv[i] >= c->arenalen)
+			return 0;
+	for (i = 0; i < c->nkeyed; i++)
+		if (ki[i] >= c->nitems)
+			return 0;
+	return 1;
+}
+
+/* map a published corpus of the file with status st copy-on-write as the
+ * item store; a corpus of another version or file contents is removed, one
+ * not owned by us alone is ignored */
+static int
+attach(const char *name, struct stat *st)
+{
+	struct timespec ts = { 0, 10000000 };
+	struct corpus c;
+	struct stat sst;
+	char *base;
+	int fd, i;
+
+	if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+		return 0;
+	if (fstat(fd, &sst) < 0 || sst.st_uid != getuid() ||
+	    (sst.st_mode & 07777) != 0600) {
+		close(fd);
+		return 0;
+	}
+	/* a corpus being published is waited for a while, one that is not
+	 * ready by then was left by a publisher that died */
+	for (i = 0; i < 100; i++) {
+		if (pread(fd, &c, sizeof c, 0) == sizeof c && c.ready)
+			break;
+		nanosleep(&ts, NULL);
+	}
+	if (i == 100 ||
+	    c.magic != CORPUSMAGIC || c.version != CORPUSVERSION ||
+	    c.itembytes != sizeof(struct item) ||
+	    c.dev != (unsigned long long)st->st_dev ||
+	    c.ino != (unsigned long long)st->st_ino ||
+	    c.size != (unsigned long long)st->st_size ||
+	    c.mtime != (unsigned long long)st->st_mtim.tv_sec ||
+	    c.mtimens != (unsigned long long)st->st_mtim.tv_nsec ||
+	    fstat(fd, &sst) < 0 || (unsigned long long)sst.st_size != c.total) {
+		/* processes that mapped it keep their copy */
+		shm_unlink(name);
+		close(fd);
+		return 0;
+	}
+	base = mmap(NULL, c.total, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return 0;
+	/* the header read may predate the mapping, check the mapped one */
+	memcpy(&c, base, sizeof c);
+	if ((unsigned long long)sst.st_size != c.total || !corpusvalid(&c, base)) {
+		munmap(base, sst.st_size);
+		shm_unlink(name);
+		return 0;
+	}
+	shmbase = base;
+	shmsize = c.total;
+	items = (struct item *)(base + c.items);
+	nitems = itemsize = c.nitems;
+	fieldv = (unsigned int *)(base + c.fieldv);
+	nfieldv = fieldvsize = c.nfieldv;
+	arena = base + c.arena;
+	arenalen = arenasize = c.arenalen;
+	keyidx = (unsigned int *)(base + c.keyidx);
+	nkeyed = keyidxsize = c.nkeyed;
+	inputbytes = c.inputbytes;
+	growmarks(nitems);
+	return 1;
 }
 
+/* copy the item store of the file with status st into a new shared memory
+ * segment; if another instance is publishing it, ours stays private */
 static void
-readstdin(void)
+publish(const char *name, struct stat *st)
+{
+	struct corpus c = { CORPUSMAGIC, CORPUSVERSION, sizeof(struct item), 0 };
+	char *base;
+	int fd;
+
+	c.dev = st->st_dev;
+	c.ino = st->st_ino;
+	c.size = st->st_size;
+	c.mtime = st->st_mtim.tv_sec;
+	c.mtimens = st->st_mtim.tv_nsec;
+	c.nitems = nitems;
+	c.nfieldv = nfieldv;
+	c.arenalen = arenalen;
+	c.nkeyed = nkeyed;
+	c.inputbytes = inputbytes;
+	c.items = ALIGN8(sizeof c);
+	c.fieldv = c.items + ALIGN8(nitems * sizeof *items);
+	c.arena = c.fieldv + ALIGN8(nfieldv * sizeof *fieldv);
+	c.keyidx = c.arena + ALIGN8(arenalen);
+	c.total = c.keyidx + nkeyed * sizeof *keyidx;
+
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+		return;
+	if (ftruncate(fd, c.total) < 0 ||
+	    (base = mmap(NULL, c.total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		shm_unlink(name);
+		close(fd);
+		return;
+	}
+	close(fd);
+	memcpy(base + c.items, items, nitems * sizeof *items);
+	memcpy(base + c.fieldv, fieldv, nfieldv * sizeof *fieldv);
+	memcpy(base + c.arena, arena, arenalen);
+	memcpy(base + c.keyidx, keyidx, nkeyed * sizeof *keyidx);
+	memcpy(base, &c, sizeof c);
+	__sync_synchronize();
+	((struct corpus *)base)->ready = 1;
+	munmap(base, c.total);
+}
+
+/* runs on the reader thread while the main thread sets up X */
+static void *
+readstdin(void *arg)
 {
-	char *line = NULL;
-	size_t i, itemsiz = 0, linesiz = 0;
+	char *line = NULL, name[64];
+	size_t linesiz = 0;
 	ssize_t len;
+	struct stat st;
+	FILE *fp = stdin;
 
     if (sif) {
      	inputw = lines = 0;
-    	return;
+    	return NULL;
   	}
+	if (protocol) /* stdin is followed instead */
+		return NULL;
+	phasebegin(PhaseStdin);
+	if (corpusfile) {
+		if (!(fp = fopen(corpusfile, "r")) || fstat(fileno(fp), &st) < 0)
+			die("open %s:", corpusfile);
+		corpusname(name, sizeof name);
+		if (attach(name, &st)) {
+			fclose(fp);
+			fp = NULL;
+		}
+	}
 
 	/* read each line from stdin and add it to the item list */
-	for (i = 0; ; i++) {
+	while (fp) {
     /* get line */
-	  len = getline(&line, &linesiz, stdin);
+	  len = getline(&line, &linesiz, fp);
     if (len == -1)
       break;
 
-    /* realloc */
-		if (i + 1 >= itemsiz) {
-			itemsiz += 256;
-			items = realloc(items, itemsiz * sizeof(*items));
-			if (items == NULL)
-				die("cannot realloc %zu bytes:", itemsiz * sizeof(*items));
-		}
-
     /* termination character */
 		if (line[len - 1] == '\n')
 			line[len - 1] = '\0';
 
-    inititem(&items[i], line);
+    additem(line);
 	}
 
 	free(line);
+	if (fp && corpusfile) {
+		fclose(fp);
+		keyindex(); /* built once for all instances sharing the corpus */
+		publish(name, &st);
+	} else if (fp) {
+		keystart(); /* overlaps X setup and the first frames */
+	}
 
-  if (items != NULL)
-		items[i].text = NULL;
-	lines = MIN(lines, i);
+	if (followfd < 0)
+		lines = MIN(lines, nitems);
+	phaseend(PhaseStdin);
+	return NULL;
+}
+
+static void
+readstart(void)
+{
+	if ((errno = pthread_create(&reader, NULL, readstdin, NULL)))
+		die("pthread_create:");
 }
 
 static void
@@ -775,7 +2566,16 @@ run(void)
 {
 	XEvent ev;
 
-	while (!XNextEvent(dpy, &ev)) {
+	for (;;) {
+		/* read followed input while no X events are queued */
+		while (followfd >= 0 && !XPending(dpy)) {
+			follow();
+			if (dirty && !XPending(dpy))
+				drawmenu();
+			if (protocol && !matchdirty)
+				report();
+		}
+		XNextEvent(dpy, &ev);
 		if (XFilterEvent(&ev, win))
 			continue;
 		switch(ev.type) {
@@ -790,10 +2590,18 @@ run(void)
 		case Expose:
 			if (ev.xexpose.count == 0)
 				drw_map(drw, win, 0, 0, mw, mh);
+			if (statsfile) {
+				phaseend(PhaseExpose);
+				writestats();
+				XSetAfterFunction(dpy, NULL);
+				statsfile = NULL;
+			}
 			break;
 		case FocusIn:
-			/* regrab focus from parent window */
-			if (ev.xfocus.window != win)
+			/* regrab focus from parent window, but not when it
+			 * is only told that the focus entered our window */
+			if (ev.xfocus.window != win && ev.xfocus.detail != NotifyVirtual &&
+			    ev.xfocus.detail != NotifyInferior)
 				grabfocus();
 			break;
 		case KeyPress:
@@ -807,76 +2615,247 @@ run(void)
 			if (ev.xvisibility.state != VisibilityUnobscured)
 				XRaiseWindow(dpy, win);
 			break;
+		default:
+			drw_event(drw, &ev); /* shared image completions */
+			break;
 		}
+		/* coalesce bursts of queued events into a single frame */
+		if (dirty && !XPending(dpy))
+			drawmenu();
+		if (protocol && !matchdirty)
+			report();
 	}
 }
 
+#ifdef XCB
+/* Send all startup queries that do not depend on each other at once, the
+ * replies are collected while or after fonts and stdin have been loaded. */
 static void
-setup(void)
+xcbquery(void)
 {
-	int x, y, i, j;
-	unsigned int du;
-	XSetWindowAttributes swa;
-	XIM xim;
-	Window w, dw, *dws;
-	XWindowAttributes wa;
-	XClassHint ch = {"dmenu", "dmenu"};
+	xcb_connection_t *c = XGetXCBConnection(dpy);
+	size_t i;
+
+	for (i = 0; i < LENGTH(atomnames); i++)
+		cookies.atoms[i] = xcb_intern_atom(c, 0, strlen(atomnames[i]), atomnames[i]);
+	if (parentwin != root)
+		cookies.parent = xcb_get_geometry(c, parentwin);
 #ifdef XINERAMA
-	XineramaScreenInfo *info;
-	Window pw;
-	int a, di, n, area = 0;
+	else {
+		/* the screens are queried once the extension is known to be there */
+		xcb_prefetch_extension_data(c, &xcb_xinerama_id);
+		cookies.focus = xcb_get_input_focus(c);
+		if (mon < 0)
+			cookies.pointer = xcb_query_pointer(c, root);
+	}
 #endif
-	/* init appearance */
-	for (j = 0; j < SchemeLast; j++)
-		scheme[j] = drw_scm_create(drw, colors[j], 2);
+	xcb_flush(c);
+	xcbbatch = 1;
+}
 
-	clip = XInternAtom(dpy, "CLIPBOARD",   False);
-	utf8 = XInternAtom(dpy, "UTF8_STRING", False);
+/* Xlib does not see the replies read through XCB, so count the wait for
+ * the startup queries here: they were sent together and cost one round
+ * trip, whichever reply is read first. */
+static void
+xcbwait(void)
+{
+	roundtrips += xcbbatch;
+	xcbbatch = 0;
+}
 
-	/* calculate menu geometry */
-	bh = drw->fonts->h + 2;
-	lines = MAX(lines, 0);
-	mh = (lines + 1) * bh;
+static void
+xcbparent(void)
+{
+	xcb_connection_t *c = XGetXCBConnection(dpy);
+	xcb_get_geometry_reply_t *r;
+	xcb_generic_error_t *e = NULL;
+
+	xcbwait();
+	if (!(r = xcb_get_geometry_reply(c, cookies.parent, &e))) {
+		free(e);
+		die("could not get embedding window attributes: 0x%lx", parentwin);
+	}
+	sw = r->width;
+	sh = r->height;
+	free(r);
+}
+
+static void
+xcbatoms(void)
+{
+	xcb_connection_t *c = XGetXCBConnection(dpy);
+	xcb_intern_atom_reply_t *r;
+	xcb_generic_error_t *e = NULL;
+	Atom atoms[LENGTH(atomnames)];
+	size_t i;
+
+	xcbwait();
+	for (i = 0; i < LENGTH(atomnames); i++) {
+		if (!(r = xcb_intern_atom_reply(c, cookies.atoms[i], &e)))
+			die("cannot intern atom %s", atomnames[i]);
+		atoms[i] = r->atom;
+		free(r);
+	}
+	clip = atoms[0];
+	utf8 = atoms[1];
+}
+
+static void
+geometry(int *x, int *y)
+{
+#ifdef XINERAMA
+	xcb_connection_t *c = XGetXCBConnection(dpy);
+	const xcb_query_extension_reply_t *ext;
+	xcb_xinerama_query_screens_reply_t *sr = NULL;
+	xcb_xinerama_screen_info_t *info;
+	xcb_get_input_focus_reply_t *fr;
+	xcb_get_geometry_cookie_t gc;
+	xcb_get_geometry_reply_t *gr;
+	xcb_translate_coordinates_cookie_t tc;
+	xcb_translate_coordinates_reply_t *tr;
+	xcb_query_pointer_reply_t *pr = NULL;
+	xcb_window_t w = XCB_NONE;
+	int a, i = 0, j, n = 0, area = 0;
+
+	/* errors just leave a reply empty, they are not fatal here */
+	if (parentwin == root) {
+		xcbwait();
+		if ((ext = xcb_get_extension_data(c, &xcb_xinerama_id)) && ext->present) {
+			sr = xcb_xinerama_query_screens_reply(c, xcb_xinerama_query_screens(c), NULL);
+			roundtrips++;
+		}
+		fr = xcb_get_input_focus_reply(c, cookies.focus, NULL);
+		if (mon < 0)
+			pr = xcb_query_pointer_reply(c, cookies.pointer, NULL);
+		n = sr ? xcb_xinerama_query_screens_screen_info_length(sr) : 0;
+		w = fr ? fr->focus : XCB_NONE;
+		free(fr);
+	}
+	if (n > 0) {
+		info = xcb_xinerama_query_screens_screen_info(sr);
+		if (mon >= 0 && mon < n) {
+			i = mon;
+		} else if (w != root && w != XCB_INPUT_FOCUS_POINTER_ROOT && w != XCB_NONE) {
+			/* both queries about the focused window go out together */
+			gc = xcb_get_geometry(c, w);
+			tc = xcb_translate_coordinates(c, w, root, 0, 0);
+			roundtrips++;
+			gr = xcb_get_geometry_reply(c, gc, NULL);
+			tr = xcb_translate_coordinates_reply(c, tc, NULL);
+			if (gr && tr)
+				for (j = 0; j < n; j++)
+					if ((a = INTERSECT(tr->dst_x, tr->dst_y, gr->width, gr->height, info[j])) > area) {
+						area = a;
+						i = j;
+					}
+			free(gr);
+			free(tr);
+		}
+		/* no focused window is on screen, so use pointer location instead */
+		if (mon < 0 && !area && pr)
+			for (i = 0; i < n; i++)
+				if (INTERSECT(pr->root_x, pr->root_y, 1, 1, info[i]) != 0)
+					break;
+		*x = info[i].x_org;
+		*y = info[i].y_org + (topbar ? 0 : info[i].height - mh);
+		mw = info[i].width;
+		free(pr);
+		free(sr);
+		return;
+	}
+	free(pr);
+	free(sr);
+#endif
+	*x = 0;
+	*y = topbar ? 0 : sh - mh;
+	mw = sw;
+}
+#else
+static void
+geometry(int *x, int *y)
+{
 #ifdef XINERAMA
-	i = 0;
+	XineramaScreenInfo *info;
+	Window w, dw;
+	unsigned int du, fw, fh;
+	int a, di, i = 0, j, n, area = 0;
+
 	if (parentwin == root && (info = XineramaQueryScreens(dpy, &n))) {
-		XGetInputFocus(dpy, &w, &di);
-		if (mon >= 0 && mon < n)
+		if (mon >= 0 && mon < n) {
 			i = mon;
-		else if (w != root && w != PointerRoot && w != None) {
-			/* find top-level window containing current input focus */
-			do {
-				if (XQueryTree(dpy, (pw = w), &dw, &w, &dws, &du) && dws)
-					XFree(dws);
-			} while (w != root && w != pw);
-			/* find xinerama screen with which the window intersects most */
-			if (XGetWindowAttributes(dpy, pw, &wa))
+		} else {
+			XGetInputFocus(dpy, &w, &di);
+			/* find xinerama screen with which the focused window intersects
+			 * most; translating its origin to root coordinates takes fewer
+			 * round trips than walking up to its top-level window */
+			if (w != root && w != PointerRoot && w != None &&
+			    XGetGeometry(dpy, w, &dw, x, y, &fw, &fh, &du, &du) &&
+			    XTranslateCoordinates(dpy, w, root, 0, 0, x, y, &dw))
 				for (j = 0; j < n; j++)
-					if ((a = INTERSECT(wa.x, wa.y, wa.width, wa.height, info[j])) > area) {
+					if ((a = INTERSECT(*x, *y, (int)fw, (int)fh, info[j])) > area) {
 						area = a;
 						i = j;
 					}
 		}
 		/* no focused window is on screen, so use pointer location instead */
-		if (mon < 0 && !area && XQueryPointer(dpy, root, &dw, &dw, &x, &y, &di, &di, &du))
+		if (mon < 0 && !area && XQueryPointer(dpy, root, &dw, &dw, x, y, &di, &di, &du))
 			for (i = 0; i < n; i++)
-				if (INTERSECT(x, y, 1, 1, info[i]) != 0)
+				if (INTERSECT(*x, *y, 1, 1, info[i]) != 0)
 					break;
 
-		x = info[i].x_org;
-		y = info[i].y_org + (topbar ? 0 : info[i].height - mh);
+		*x = info[i].x_org;
+		*y = info[i].y_org + (topbar ? 0 : info[i].height - mh);
 		mw = info[i].width;
 		XFree(info);
-	} else
-#endif
-	{
-		if (!XGetWindowAttributes(dpy, parentwin, &wa))
-			die("could not get embedding window attributes: 0x%lx",
-			    parentwin);
-		x = 0;
-		y = topbar ? 0 : wa.height - mh;
-		mw = wa.width;
+		return;
 	}
+#endif
+	*x = 0;
+	*y = topbar ? 0 : sh - mh;
+	mw = sw;
+}
+#endif
+
+static void
+setup(void)
+{
+	int x, y, i, j;
+	unsigned int du;
+	XSetWindowAttributes swa;
+	XIM xim;
+	Window w, dw, *dws;
+	XClassHint ch = {"dmenu", "dmenu"};
+#ifndef XCB
+	Atom atoms[LENGTH(atomnames)];
+#endif
+	phasebegin(PhaseSetup);
+	/* init appearance */
+	for (j = 0; j < SchemeLast; j++)
+		scheme[j] = drw_scm_create(drw, colors[j], 2);
+
+#ifdef XCB
+	xcbatoms();
+#else
+	XInternAtoms(dpy, atomnames, LENGTH(atomnames), False, atoms);
+	clip = atoms[0];
+	utf8 = atoms[1];
+#endif
+
+	/* input methods */
+	if ((xim = XOpenIM(dpy, NULL, NULL, NULL)) == NULL)
+		die("XOpenIM failed: could not open input device");
+
+	/* the geometry depends on the items, wait for stdin to be read */
+	if ((errno = pthread_join(reader, NULL)))
+		die("pthread_join:");
+	if (!fast)
+		grabkeyboard();
+
+	/* calculate menu geometry */
+	bh = drw->fonts->h + 2;
+	lines = MAX(lines, 0);
+	mh = (lines + 1) * bh;
+	geometry(&x, &y);
 	promptw = (prompt && *prompt) ? TEXTW(prompt) - lrpad / 4 : 0;
 	inputw = mw / 3; /* input width: ~33% of monitor width */
 	match();
@@ -884,17 +2863,12 @@ setup(void)
 	/* create menu window */
 	swa.override_redirect = True;
 	swa.background_pixel = scheme[SchemeNorm][ColBg].pixel;
-	swa.event_mask = ExposureMask | KeyPressMask | VisibilityChangeMask;
+	swa.event_mask = ExposureMask | KeyPressMask | VisibilityChangeMask | FocusChangeMask;
 	win = XCreateWindow(dpy, root, x, y, mw, mh, 0,
 	                    CopyFromParent, CopyFromParent, CopyFromParent,
 	                    CWOverrideRedirect | CWBackPixel | CWEventMask, &swa);
 	XSetClassHint(dpy, win, &ch);
 
-
-	/* input methods */
-	if ((xim = XOpenIM(dpy, NULL, NULL, NULL)) == NULL)
-		die("XOpenIM failed: could not open input device");
-
 	xic = XCreateIC(xim, XNInputStyle, XIMPreeditNothing | XIMStatusNothing,
 	                XNClientWindow, win, XNFocusWindow, win, NULL);
 
@@ -911,21 +2885,28 @@ setup(void)
 	}
 	drw_resize(drw, mw, mh);
 	drawmenu();
+	phaseend(PhaseSetup);
+	phasebegin(PhaseExpose);
 }
 
 static void
 usage(void)
 {
-	die("usage: dmenu [-bfisvP] [-l lines] [-p prompt] [-fn font] [-m monitor]\n"
-	    "             [-nb color] [-nf color] [-sb color] [-sf color] [-w windowid]");
+	die("usage: dmenu [-bcfinrsvzBP] [-l lines] [-p prompt] [-fn font] [-m monitor]\n"
+	    "             [-nb color] [-nf color] [-sb color] [-sf color] [-w windowid]\n"
+	    "             [-S statsfile] [-mf fields] [-df field] [-of fields]\n"
+	    "             [-F file] [-O order] [-C corpus]");
 }
 
 int
 main(int argc, char *argv[])
 {
+#ifndef XCB
 	XWindowAttributes wa;
-	int i, fast = 0;
+#endif
+	int i;
 
+	clock_gettime(CLOCK_MONOTONIC, &t0);
 	for (i = 1; i < argc; i++)
 		/* these options take no arguments */
 		if (!strcmp(argv[i], "-v")) {      /* prints version information */
@@ -940,8 +2921,19 @@ main(int argc, char *argv[])
 		else if (!strcmp(argv[i], "-s")) { /* case-sensitive item matching */
 			fstrncmp = strncmp;
 			fstrstr = strstr;
-  		} else if (!strcmp(argv[i], "-P"))   /* is the input a password */
+  		} else if (!strcmp(argv[i], "-r"))   /* regex item matching */
+			useregex = 1;
+		else if (!strcmp(argv[i], "-c")) { /* commands on stdin, events on stdout */
+			protocol = 1;
+			followfd = STDIN_FILENO;
+		} else if (!strcmp(argv[i], "-P"))   /* is the input a password */
 			sif = 1;
+		else if (!strcmp(argv[i], "-z"))   /* NUL-separated output */
+			outsep = '\0';
+		else if (!strcmp(argv[i], "-n"))   /* output item line numbers */
+			outindex = 1;
+		else if (!strcmp(argv[i], "-B"))   /* write selections at exit */
+			outbuffered = 1;
 		else if (i + 1 == argc)
 			usage();
 		/* these options take one argument */
@@ -954,46 +2946,99 @@ main(int argc, char *argv[])
 		else if (!strcmp(argv[i], "-fn"))  /* font or font set */
 			fonts[0] = argv[++i];
 		else if (!strcmp(argv[i], "-nb"))  /* normal background color */
-			colors[SchemeNorm][ColBg] = argv[++i];
+			colors[SchemeNorm][ColBg] = colors[SchemeNormHl][ColBg] = argv[++i];
 		else if (!strcmp(argv[i], "-nf"))  /* normal foreground color */
 			colors[SchemeNorm][ColFg] = argv[++i];
 		else if (!strcmp(argv[i], "-sb"))  /* selected background color */
-			colors[SchemeSel][ColBg] = argv[++i];
+			colors[SchemeSel][ColBg] = colors[SchemeSelHl][ColBg] = argv[++i];
 		else if (!strcmp(argv[i], "-sf"))  /* selected foreground color */
 			colors[SchemeSel][ColFg] = argv[++i];
 		else if (!strcmp(argv[i], "-w"))   /* embedding window id */
 			embed = argv[++i];
+		else if (!strcmp(argv[i], "-S"))   /* write startup profile */
+			statsfile = argv[++i];
+		else if (!strcmp(argv[i], "-F")) { /* follow file for more items */
+			if ((followfd = open(argv[++i], O_RDONLY | O_NONBLOCK)) < 0)
+				die("open %s:", argv[i]);
+		}
+		else if (!strcmp(argv[i], "-mf"))  /* fields to match */
+			matchfields = fieldlist(argv[++i]);
+		else if (!strcmp(argv[i], "-df"))  /* field to display */
+			dispfield = MAX(atoi(argv[++i]), 1) - 1;
+		else if (!strcmp(argv[i], "-of"))  /* fields to output */
+			outfields = fieldlist(argv[++i]);
+		else if (!strcmp(argv[i], "-C"))   /* shared corpus file */
+			corpusfile = argv[++i];
+		else if (!strcmp(argv[i], "-O")) { /* order of the matches */
+			i++;
+			if (!strcmp(argv[i], "length"))
+				sortby = SortLength;
+			else if (!strcmp(argv[i], "alpha"))
+				sortby = SortAlpha;
+			else if (!strcmp(argv[i], "position"))
+				sortby = SortPosition;
+			else if (strcmp(argv[i], "input"))
+				usage();
+		}
 		else
 			usage();
+	phaseend(PhaseArgs); /* began at t0 */
 
 	if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
 		fputs("warning: no locale support\n", stderr);
+	fast = fast && !isatty(0);
+	/* stdin is read on its own thread while fonts, colors and the input
+	 * method are set up, unless the keyboard has to be grabbed first */
+	if (!fast)
+		readstart();
+	phasebegin(PhaseDisplay);
 	if (!(dpy = XOpenDisplay(NULL)))
 		die("cannot open display");
+	phaseend(PhaseDisplay);
+	if (statsfile) {
+		lastread = LastKnownRequestProcessed(dpy);
+		XSetAfterFunction(dpy, countroundtrip);
+	}
 	screen = DefaultScreen(dpy);
 	root = RootWindow(dpy, screen);
+	if (fast) {
+		grabkeyboard();
+		readstart();
+	}
 	if (!embed || !(parentwin = strtol(embed, NULL, 0)))
 		parentwin = root;
-	if (!XGetWindowAttributes(dpy, parentwin, &wa))
-		die("could not get embedding window attributes: 0x%lx",
-		    parentwin);
-	drw = drw_create(dpy, screen, root, wa.width, wa.height);
+#ifdef XCB
+	xcbquery();
+#endif
+	if (parentwin == root) {
+		sw = DisplayWidth(dpy, screen);
+		sh = DisplayHeight(dpy, screen);
+	} else {
+#ifdef XCB
+		xcbparent();
+#else
+		if (!XGetWindowAttributes(dpy, parentwin, &wa))
+			die("could not get embedding window attributes: 0x%lx",
+			    parentwin);
+		sw = wa.width;
+		sh = wa.height;
+#endif
+	}
+	phasebegin(PhaseDrw);
+	drw = drw_create(dpy, screen, root, sw, sh);
+	phaseend(PhaseDrw);
+	phasebegin(PhaseFonts);
 	if (!drw_fontset_create(drw, fonts, LENGTH(fonts)))
 		die("no fonts could be loaded.");
+	phaseend(PhaseFonts);
 	lrpad = drw->fonts->h;
 
 #ifdef __OpenBSD__
-	if (pledge("stdio rpath", NULL) == -1)
+	if (pledge(statsfile || corpusfile ? "stdio rpath wpath cpath" : "stdio rpath", NULL) == -1)
 		die("pledge");
 #endif
 
-	if (fast && !isatty(0)) {
-		grabkeyboard();
-		readstdin();
-	} else {
-		readstdin();
-		grabkeyboard();
-	}
+	text = ecalloc(1, textsize = BUFSIZ);
 	setup();
 	run();
 
@@ -1,8 +1,14 @@
 /* See LICENSE file for copyright and license details. */
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#ifdef SHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#endif
 #include <X11/Xft/Xft.h>
 
 #include "drw.h"
@@ -11,6 +17,11 @@
 #define UTF_INVALID 0xFFFD
 #define UTF_SIZ     4
 
+#define ISPRINT(c)  ((unsigned char)(c) - 0x20U < 0x5f)
+#define ONES        ((size_t)-1 / 0xff)
+/* nonzero if any byte of the word is outside the printable ASCII range */
+#define NONPRINT(x) ((((x) - ONES * 0x20) | (x) | (((x) ^ ONES * 0x7f) - ONES)) & ONES * 0x80)
+
 static const unsigned char utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const unsigned char utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
 static const long utfmin[UTF_SIZ + 1] = {       0,    0,  0x80,  0x800,  0x10000};
@@ -60,6 +71,242 @@ utf8decode(const char *c, long *u, size_t clen)
 	return len;
 }
 
+#ifdef SHM
+#define GLYPHCACHE 512
+
+typedef struct {
+	XftFont *font;
+	FT_UInt glyph;
+	int left, top;
+	unsigned int w, h;
+	unsigned char *alpha;
+} Bitmap;
+
+static Bitmap bitmaps[GLYPHCACHE]; /* rendered glyph coverage, direct mapped */
+static int shmfailed;
+
+static int
+shmerror(Display *dpy, XErrorEvent *ee)
+{
+	shmfailed = 1;
+	return 0;
+}
+
+/* the server is done reading the shared image */
+static Bool
+imgdone(Display *dpy, XEvent *ev, XPointer arg)
+{
+	Drw *drw = (Drw *)arg;
+
+	return ev->type == XShmGetEventBase(dpy) + ShmCompletion &&
+	       ((XShmCompletionEvent *)ev)->shmseg == drw->shminfo.shmseg;
+}
+
+/* wait until the framebuffer may be written to again */
+static void
+imgwait(Drw *drw)
+{
+	XEvent ev;
+
+	if (drw->busy) {
+		XIfEvent(drw->dpy, &ev, imgdone, (XPointer)drw);
+		drw->busy = 0;
+	}
+}
+
+static void
+imgfree(Drw *drw)
+{
+	if (!drw->img)
+		return;
+	imgwait(drw);
+	if (drw->shm) {
+		XShmDetach(drw->dpy, &drw->shminfo);
+		shmdt(drw->shminfo.shmaddr);
+		drw->img->data = NULL;
+	}
+	XDestroyImage(drw->img);
+	drw->img = NULL;
+}
+
+/* Create the client-side framebuffer. Only 32 bit TrueColor images in host
+ * byte order are rasterized here, everything else is drawn on the server. */
+static int
+imgcreate(Drw *drw, unsigned int w, unsigned int h)
+{
+	Visual *vis = DefaultVisual(drw->dpy, drw->screen);
+	int depth = DefaultDepth(drw->dpy, drw->screen);
+	int (*xerror)(Display *, XErrorEvent *);
+	unsigned int one = 1;
+	char *data;
+
+	if (vis->class != TrueColor || vis->red_mask != 0xff0000 ||
+	    vis->green_mask != 0xff00 || vis->blue_mask != 0xff)
+		return 0;
+	w = MAX(w, 1);
+	h = MAX(h, 1);
+
+	drw->shm = 0;
+	if (XShmQueryExtension(drw->dpy) &&
+	    (drw->img = XShmCreateImage(drw->dpy, vis, depth, ZPixmap, NULL,
+	                                &drw->shminfo, w, h))) {
+		drw->shminfo.shmid = shmget(IPC_PRIVATE, drw->img->bytes_per_line * h,
+		                            IPC_CREAT | 0600);
+		if (drw->shminfo.shmid != -1) {
+			drw->shminfo.shmaddr = drw->img->data = shmat(drw->shminfo.shmid, NULL, 0);
+			drw->shminfo.readOnly = False;
+			/* attaching fails on remote displays, find out now */
+			shmfailed = 0;
+			xerror = XSetErrorHandler(shmerror);
+			if (drw->shminfo.shmaddr != (char *)-1 && XShmAttach(drw->dpy, &drw->shminfo))
+				XSync(drw->dpy, False);
+			else
+				shmfailed = 1;
+			XSetErrorHandler(xerror);
+			if (drw->shminfo.shmaddr != (char *)-1) {
+				if (shmfailed)
+					shmdt(drw->shminfo.shmaddr);
+				shmctl(drw->shminfo.shmid, IPC_RMID, NULL);
+			}
+			drw->shm = !shmfailed;
+		}
+		if (!drw->shm) {
+			drw->img->data = NULL;
+			XDestroyImage(drw->img);
+			drw->img = NULL;
+		}
+	}
+	if (!drw->img) {
+		data = ecalloc(h, w * 4);
+		if (!(drw->img = XCreateImage(drw->dpy, vis, depth, ZPixmap, 0, data,
+		                              w, h, 32, 0))) {
+			free(data);
+			return 0;
+		}
+	}
+	if (drw->img->bits_per_pixel != 32 ||
+	    drw->img->byte_order != (*(char *)&one ? LSBFirst : MSBFirst)) {
+		imgfree(drw);
+		return 0;
+	}
+	return 1;
+}
+
+static void
+imgfill(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned long pixel)
+{
+	XImage *img = drw->img;
+	uint32_t *row;
+	int x1, y1, i;
+
+	imgwait(drw);
+	x1 = MIN(x + (int)w, img->width);
+	y1 = MIN(y + (int)h, img->height);
+	x = MAX(x, 0);
+	for (y = MAX(y, 0); y < y1; y++) {
+		row = (uint32_t *)(img->data + y * img->bytes_per_line);
+		for (i = x; i < x1; i++)
+			row[i] = pixel;
+	}
+}
+
+static Bitmap *
+imgglyph(XftFont *font, FT_UInt glyph)
+{
+	Bitmap *b = &bitmaps[((uintptr_t)font / sizeof(void *) * 31 + glyph) % GLYPHCACHE];
+	FT_Bitmap *src;
+	FT_Face face;
+	unsigned int i, j;
+
+	if (b->font == font && b->glyph == glyph)
+		return b;
+
+	free(b->alpha);
+	memset(b, 0, sizeof(*b));
+	b->font = font;
+	b->glyph = glyph;
+	if (!(face = XftLockFace(font)))
+		return b;
+	if (!FT_Load_Glyph(face, glyph, FT_LOAD_DEFAULT | FT_LOAD_RENDER | FT_LOAD_COLOR)) {
+		src = &face->glyph->bitmap;
+		b->w = src->width;
+		b->h = src->rows;
+		b->left = face->glyph->bitmap_left;
+		b->top = face->glyph->bitmap_top;
+		b->alpha = ecalloc(MAX(b->w * b->h, 1), 1);
+		for (j = 0; j < b->h; j++) {
+			for (i = 0; i < b->w; i++) {
+				switch (src->pixel_mode) {
+				case FT_PIXEL_MODE_MONO:
+					if (src->buffer[j * src->pitch + i / 8] & (0x80 >> (i % 8)))
+						b->alpha[j * b->w + i] = 0xff;
+					break;
+				case FT_PIXEL_MODE_GRAY:
+					b->alpha[j * b->w + i] = src->buffer[j * src->pitch + i];
+					break;
+				case FT_PIXEL_MODE_BGRA: /* color glyphs are drawn in the text color */
+					b->alpha[j * b->w + i] = src->buffer[j * src->pitch + i * 4 + 3];
+					break;
+				}
+			}
+		}
+	}
+	XftUnlockFace(font);
+	return b;
+}
+
+static void
+imgglyphs(Drw *drw, Clr *clr, XftGlyphFontSpec *specs, unsigned int len)
+{
+	XImage *img = drw->img;
+	unsigned long fg = clr->pixel;
+	unsigned int a, c, i, j, k, px, py;
+	uint32_t *p;
+	Bitmap *b;
+
+	imgwait(drw);
+	for (k = 0; k < len; k++) {
+		b = imgglyph(specs[k].font, specs[k].glyph);
+		for (j = 0; j < b->h; j++) {
+			py = specs[k].y - b->top + j;
+			if (py >= (unsigned int)img->height)
+				continue;
+			for (i = 0; i < b->w; i++) {
+				px = specs[k].x + b->left + i;
+				if (px >= (unsigned int)img->width || !(a = b->alpha[j * b->w + i]))
+					continue;
+				p = (uint32_t *)(img->data + py * img->bytes_per_line) + px;
+				for (c = 0; c < 24; c += 8)
+					*p = (*p & ~(0xffu << c)) |
+					     (((((fg >> c) & 0xff) * a + ((*p >> c) & 0xff) * (255 - a)) / 255) << c);
+			}
+		}
+	}
+}
+#endif
+
+/* Length of the leading run of printable ASCII characters, checked a
+ * word at a time. Aligned words never cross a page boundary, so reading
+ * the word holding the terminating NUL is safe. */
+static size_t
+asciilen(const char *s)
+{
+	const char *p = s;
+	size_t v;
+
+	for (; (uintptr_t)p % sizeof(v); p++)
+		if (!ISPRINT(*p))
+			return p - s;
+	for (;; p += sizeof(v)) {
+		memcpy(&v, p, sizeof(v));
+		if (NONPRINT(v))
+			break;
+	}
+	for (; ISPRINT(*p); p++)
+		;
+	return p - s;
+}
+
 Drw *
 drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h)
 {
@@ -70,9 +317,15 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 	drw->root = root;
 	drw->w = w;
 	drw->h = h;
-	drw->drawable = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
 	drw->gc = XCreateGC(dpy, root, 0, NULL);
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
+#ifdef SHM
+	if (imgcreate(drw, w, h))
+		return drw;
+#endif
+	drw->drawable = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
+	drw->xftdraw = XftDrawCreate(dpy, drw->drawable, DefaultVisual(dpy, screen),
+	                             DefaultColormap(dpy, screen));
 
 	return drw;
 }
@@ -80,20 +333,46 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 void
 drw_resize(Drw *drw, unsigned int w, unsigned int h)
 {
+	size_t i;
+
 	if (!drw)
 		return;
 
+	/* glyphs queued for the old pixmap are dropped along with it */
+	for (i = 0; i < LENGTH(drw->glyphs); i++)
+		drw->glyphs[i].len = 0;
 	drw->w = w;
 	drw->h = h;
+#ifdef SHM
+	if (drw->img) {
+		imgfree(drw);
+		if (imgcreate(drw, w, h))
+			return;
+		/* the new size cannot be rasterized here, continue on the server */
+		drw->xftdraw = XftDrawCreate(drw->dpy, None, DefaultVisual(drw->dpy, drw->screen),
+		                             DefaultColormap(drw->dpy, drw->screen));
+	}
+#endif
 	if (drw->drawable)
 		XFreePixmap(drw->dpy, drw->drawable);
 	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+	XftDrawChange(drw->xftdraw, drw->drawable);
 }
 
 void
 drw_free(Drw *drw)
 {
-	XFreePixmap(drw->dpy, drw->drawable);
+	size_t i;
+
+	for (i = 0; i < LENGTH(drw->glyphs); i++)
+		free(drw->glyphs[i].specs);
+#ifdef SHM
+	imgfree(drw);
+#endif
+	if (drw->xftdraw)
+		XftDrawDestroy(drw->xftdraw);
+	if (drw->drawable)
+		XFreePixmap(drw->dpy, drw->drawable);
 	XFreeGC(drw->dpy, drw->gc);
 	drw_fontset_free(drw->fonts);
 	free(drw);
@@ -145,8 +424,19 @@ xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 static void
 xfont_free(Fnt *font)
 {
+#ifdef SHM
+	size_t i;
+#endif
+
 	if (!font)
 		return;
+#ifdef SHM
+	for (i = 0; i < LENGTH(bitmaps); i++)
+		if (bitmaps[i].font == font->xfont) {
+			free(bitmaps[i].alpha);
+			memset(&bitmaps[i], 0, sizeof(bitmaps[i]));
+		}
+#endif
 	if (font->pattern)
 		FcPatternDestroy(font->pattern);
 	XftFontClose(font->dpy, font->xfont);
@@ -171,6 +461,29 @@ drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 	return (drw->fonts = ret);
 }
 
+/* Check once whether the font has every printable ASCII character and
+ * remember their glyphs and advances. */
+static int
+fontascii(Fnt *font)
+{
+	XGlyphInfo ext;
+	int c;
+
+	if (font->ascii)
+		return font->ascii > 0;
+	font->ascii = 1;
+	for (c = 0x20; c < 0x7f; c++) {
+		if (!XftCharExists(font->dpy, font->xfont, c)) {
+			font->ascii = -1;
+			break;
+		}
+		font->asciiglyph[c] = XftCharIndex(font->dpy, font->xfont, c);
+		XftGlyphExtents(font->dpy, font->xfont, &font->asciiglyph[c], 1, &ext);
+		font->asciiw[c] = ext.xOff;
+	}
+	return font->ascii > 0;
+}
+
 void
 drw_fontset_free(Fnt *font)
 {
@@ -223,16 +536,132 @@ drw_setscheme(Drw *drw, Clr *scm)
 		drw->scheme = scm;
 }
 
+/* highlight the n sorted, disjoint spans of the next drw_text call, given
+ * as byte offsets of their starts and ends, with scm */
+void
+drw_sethl(Drw *drw, Clr *scm, const unsigned int *spans, unsigned int n)
+{
+	if (!drw)
+		return;
+	drw->hlscheme = scm;
+	drw->hl = spans;
+	drw->nhl = n;
+}
+
+static void
+fillrect(Drw *drw, int x, int y, unsigned int w, unsigned int h, Clr *clr)
+{
+#ifdef SHM
+	if (drw->img) {
+		imgfill(drw, x, y, w, h, clr->pixel);
+		return;
+	}
+#endif
+	XSetForeground(drw->dpy, drw->gc, clr->pixel);
+	XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
+}
+
 void
 drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert)
 {
+	Clr *clr;
+
 	if (!drw || !drw->scheme)
 		return;
-	XSetForeground(drw->dpy, drw->gc, invert ? drw->scheme[ColBg].pixel : drw->scheme[ColFg].pixel);
-	if (filled)
-		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-	else
+	/* rectangles may be drawn on top of text, keep the drawing order */
+	drw_flush(drw);
+	clr = &drw->scheme[invert ? ColBg : ColFg];
+	if (filled) {
+		fillrect(drw, x, y, w, h, clr);
+	} else if (w && h) {
+#ifdef SHM
+		if (drw->img) {
+			fillrect(drw, x, y, w, 1, clr);
+			fillrect(drw, x, y + h - 1, w, 1, clr);
+			fillrect(drw, x, y, 1, h, clr);
+			fillrect(drw, x + w - 1, y, 1, h, clr);
+			return;
+		}
+#endif
+		XSetForeground(drw->dpy, drw->gc, clr->pixel);
 		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
+	}
+}
+
+static void
+queueglyphs(Drw *drw, Clr *clr, Fnt *font, int x, int y, const char *text, int len)
+{
+	Glyphs *g;
+	XGlyphInfo ext;
+	FT_UInt glyph;
+	long u;
+	size_t i;
+	int n;
+
+	for (i = 0; i < LENGTH(drw->glyphs) && drw->glyphs[i].len; i++)
+		if (drw->glyphs[i].clr == clr)
+			break;
+	if (i == LENGTH(drw->glyphs)) {
+		/* out of color slots: send everything queued so far */
+		drw_flush(drw);
+		i = 0;
+	}
+	g = &drw->glyphs[i];
+	g->clr = clr;
+
+	for (; len > 0; text += n, len -= n) {
+		if (ISPRINT(*text) && font->ascii > 0) {
+			n = 1;
+		} else if (!(n = utf8decode(text, &u, len))) {
+			break;
+		}
+		if (g->len == g->size) {
+			g->size = g->size ? g->size * 2 : 256;
+			if (!(g->specs = realloc(g->specs, g->size * sizeof(*g->specs))))
+				die("cannot realloc %zu bytes:", g->size * sizeof(*g->specs));
+		}
+		if (n == 1 && ISPRINT(*text) && font->ascii > 0) {
+			glyph = font->asciiglyph[(unsigned char)*text];
+			ext.xOff = font->asciiw[(unsigned char)*text];
+		} else {
+			glyph = XftCharIndex(drw->dpy, font->xfont, u);
+			XftGlyphExtents(drw->dpy, font->xfont, &glyph, 1, &ext);
+		}
+		g->specs[g->len].font = font->xfont;
+		g->specs[g->len].glyph = glyph;
+		g->specs[g->len].x = x;
+		g->specs[g->len].y = y;
+		g->len++;
+		x += ext.xOff;
+	}
+}
+
+/* queue the glyphs of text[s..e) in clr, those within highlighted spans in
+ * the highlight colors on their background */
+static void
+queuespans(Drw *drw, Clr *clr, Fnt *font, int x, int y, unsigned int h, int ty,
+           const char *text, unsigned int s, unsigned int e)
+{
+	unsigned int i, a, b, w;
+
+	for (i = 0; i < drw->nhl && s < e; i++) {
+		a = MAX(drw->hl[2 * i], s);
+		b = MIN(drw->hl[2 * i + 1], e);
+		if (a >= b)
+			continue;
+		if (a > s) {
+			queueglyphs(drw, clr, font, x, ty, text + s, a - s);
+			drw_font_getexts(font, text + s, a - s, &w, NULL);
+			x += w;
+		}
+		drw_font_getexts(font, text + a, b - a, &w, NULL);
+		fillrect(drw, x, y, w, h, &drw->hlscheme[ColBg]);
+		queueglyphs(drw, &drw->hlscheme[ColFg], font, x, ty, text + a, b - a);
+		x += w;
+		s = b;
+	}
+	if (s < e)
+		queueglyphs(drw, clr, font, x, ty, text + s, e - s);
 }
 
 int
@@ -240,30 +669,31 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 {
 	int ty, ellipsis_x = 0;
 	unsigned int tmpw, ew, ellipsis_w = 0, ellipsis_len, hash, h0, h1;
-	XftDraw *d = NULL;
 	Fnt *usedfont, *curfont, *nextfont;
 	int utf8strlen, utf8charlen, render = x || y || w || h;
 	long utf8codepoint = 0;
-	const char *utf8str;
+	const char *utf8str, *start = text;
 	FcCharSet *fccharset;
 	FcPattern *fcpattern;
 	FcPattern *match;
 	XftResult result;
-	int charexists = 0, overflow = 0;
+	int charexists = 0, overflow = 0, ascii = 1, efit, i, ne;
+	unsigned int we;
 	/* keep track of a couple codepoints for which we have no match. */
 	static unsigned int nomatches[128], ellipsis_width;
 
-	if (!drw || (render && (!drw->scheme || !w)) || !text || !drw->fonts)
+	if (!drw)
+		return 0;
+	if ((render && (!drw->scheme || !w)) || !text || !drw->fonts) {
+		if (render)
+			drw->nhl = 0;
 		return 0;
+	}
 
 	if (!render) {
 		w = invert ? invert : ~invert;
 	} else {
-		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
-		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-		d = XftDrawCreate(drw->dpy, drw->drawable,
-		                  DefaultVisual(drw->dpy, drw->screen),
-		                  DefaultColormap(drw->dpy, drw->screen));
+		fillrect(drw, x, y, w, h, &drw->scheme[invert ? ColFg : ColBg]);
 		x += lpad;
 		w -= lpad;
 	}
@@ -276,6 +706,40 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		utf8str = text;
 		nextfont = NULL;
 		while (*text) {
+			/* a run of printable ASCII is claimed by the first font as a
+			 * whole when it covers ASCII: measure it in one pass with the
+			 * cached advances. It is taken whole if it fits, with room for
+			 * the ellipsis only if more text follows, else up to where the
+			 * ellipsis still fits and the rest goes char by char */
+			if (ascii && !charexists && usedfont == drw->fonts && fontascii(usedfont) &&
+			    (utf8charlen = asciilen(text))) {
+				efit = ew + ellipsis_width <= w;
+				for (i = ne = 0, tmpw = we = 0; i < utf8charlen; i++) {
+					if (ew + tmpw + usedfont->asciiw[(unsigned char)text[i]] > w)
+						break;
+					tmpw += usedfont->asciiw[(unsigned char)text[i]];
+					if (ew + tmpw + ellipsis_width <= w) {
+						ne = i + 1;
+						we = tmpw;
+						efit = 1;
+					}
+				}
+				if (efit) {
+					ellipsis_x = x + ew + we;
+					ellipsis_w = w - ew - we;
+					ellipsis_len = utf8strlen + ne;
+				}
+				if (i < utf8charlen || (text[i] && ne < i)) {
+					i = ne;
+					tmpw = we;
+					ascii = 0;
+				}
+				utf8strlen += i;
+				text += i;
+				ew += tmpw;
+				if (ascii)
+					continue;
+			}
 			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
 			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
 				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
@@ -317,14 +781,21 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		if (utf8strlen) {
 			if (render) {
 				ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-				XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
-				                  usedfont->xfont, x, ty, (XftChar8 *)utf8str, utf8strlen);
+				if (drw->nhl)
+					queuespans(drw, &drw->scheme[invert ? ColBg : ColFg], usedfont,
+					           x, y, h, ty, start, utf8str - start,
+					           utf8str - start + utf8strlen);
+				else
+					queueglyphs(drw, &drw->scheme[invert ? ColBg : ColFg],
+					            usedfont, x, ty, utf8str, utf8strlen);
 			}
 			x += ew;
 			w -= ew;
 		}
-		if (render && overflow)
+		if (render && overflow) {
+			drw->nhl = 0;
 			drw_text(drw, ellipsis_x, y, ellipsis_w, h, 0, "...", invert);
+		}
 
 		if (!*text || overflow) {
 			break;
@@ -379,20 +850,65 @@ no_match:
 			}
 		}
 	}
-	if (d)
-		XftDrawDestroy(d);
-
+	if (render)
+		drw->nhl = 0; /* spans are for one text */
 	return x + (render ? w : 0);
 }
 
+void
+drw_flush(Drw *drw)
+{
+	size_t i;
+
+	if (!drw)
+		return;
+
+	/* one render request per color for everything drawn since the last flush */
+	for (i = 0; i < LENGTH(drw->glyphs) && drw->glyphs[i].len; i++) {
+#ifdef SHM
+		if (drw->img)
+			imgglyphs(drw, drw->glyphs[i].clr, drw->glyphs[i].specs, drw->glyphs[i].len);
+		else
+#endif
+		XftDrawGlyphFontSpec(drw->xftdraw, drw->glyphs[i].clr,
+		                     drw->glyphs[i].specs, drw->glyphs[i].len);
+		drw->glyphs[i].len = 0;
+	}
+}
+
 void
 drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
 {
 	if (!drw)
 		return;
 
+	drw_flush(drw);
+#ifdef SHM
+	if (drw->img) {
+		imgwait(drw);
+		if (drw->shm)
+			drw->busy = XShmPutImage(drw->dpy, win, drw->gc, drw->img, x, y, x, y, w, h, True);
+		else
+			XPutImage(drw->dpy, win, drw->gc, drw->img, x, y, x, y, w, h);
+		XFlush(drw->dpy);
+		return;
+	}
+#endif
 	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
-	XSync(drw->dpy, False);
+	XFlush(drw->dpy);
+}
+
+/* handle an event of the drawing backend, nonzero if ev was one */
+int
+drw_event(Drw *drw, XEvent *ev)
+{
+#ifdef SHM
+	if (drw && drw->shm && imgdone(drw->dpy, ev, (XPointer)drw)) {
+		drw->busy = 0;
+		return 1;
+	}
+#endif
+	return 0;
 }
 
 unsigned int
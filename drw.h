@@ -1,4 +1,7 @@
 /* See LICENSE file for copyright and license details. */
+#ifdef SHM
+#include <X11/extensions/XShm.h>
+#endif
 
 typedef struct {
 	Cursor cursor;
@@ -9,21 +12,40 @@ typedef struct Fnt {
 	unsigned int h;
 	XftFont *xfont;
 	FcPattern *pattern;
+	int ascii; /* printable ASCII coverage: 0 unknown, 1 covered, -1 not */
+	FT_UInt asciiglyph[128];
+	int asciiw[128];
 	struct Fnt *next;
 } Fnt;
 
 enum { ColFg, ColBg }; /* Clr scheme index */
 typedef XftColor Clr;
 
+typedef struct {
+	Clr *clr;
+	XftGlyphFontSpec *specs;
+	unsigned int len, size;
+} Glyphs; /* glyphs queued for one color, sent on drw_flush */
+
 typedef struct {
 	unsigned int w, h;
 	Display *dpy;
 	int screen;
 	Window root;
 	Drawable drawable;
+	XftDraw *xftdraw;
 	GC gc;
 	Clr *scheme;
+	Clr *hlscheme; /* colors of the highlighted spans of the next text */
+	const unsigned int *hl; /* byte offsets of span starts and ends */
+	unsigned int nhl;
 	Fnt *fonts;
+	Glyphs glyphs[6];
+#ifdef SHM
+	XImage *img; /* client-side framebuffer, NULL when drawing on the server */
+	XShmSegmentInfo shminfo;
+	int shm, busy;
+#endif
 } Drw;
 
 /* Drawable abstraction */
@@ -49,10 +71,13 @@ void drw_cur_free(Drw *drw, Cur *cursor);
 /* Drawing context manipulation */
 void drw_setfontset(Drw *drw, Fnt *set);
 void drw_setscheme(Drw *drw, Clr *scm);
+void drw_sethl(Drw *drw, Clr *scm, const unsigned int *spans, unsigned int n);
 
 /* Drawing functions */
 void drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert);
 int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert);
 
 /* Map functions */
+void drw_flush(Drw *drw);
 void drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h);
+int drw_event(Drw *drw, XEvent *ev);
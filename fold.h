@@ -0,0 +1,7 @@
+/* See LICENSE file for copyright and license details. */
+
+/* bytes needed to fold a string of n bytes: no rune grows by more than half */
+#define FOLDSIZE(n)             ((n) + (n) / 2 + 1)
+
+unsigned long foldrune(unsigned long c);
+int utf8fold(char *dst, const char *src);
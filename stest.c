@@ -3,44 +3,300 @@
 
 #include <dirent.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef IOURING
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 
 #include "arg.h"
 char *argv0;
 
 #define FLAG(x)  (flag[(x)-'a'])
+#define BATCH    1024 /* paths gathered at once with -j */
+#define NTHREADS 16
+#define RINGSIZE 256
 
-static void test(const char *, const char *);
+struct entry {
+	const char *path;
+	struct stat st, ln;
+	int stok, lnok; /* stat and lstat succeeded */
+	int acc[4];     /* access(2) for -e, -r, -w and -x, -1 if not called */
+};
+
+struct job {
+	struct entry *v;
+	size_t n, next;
+	int what;
+};
+
+enum { GatherStat = 1, GatherAccess = 2 };
+
+static void test(struct entry *, const char *);
 static void usage(void);
 
 static int match = 0;
 static int flag[26];
 static struct stat old, new;
+static const int accmode[4] = { F_OK, R_OK, W_OK, X_OK };
+static const char accflag[4] = "erwx";
 
+static int
+can(struct entry *e, int i)
+{
+	if (e->acc[i] < 0)
+		e->acc[i] = access(e->path, accmode[i]) == 0;
+	return e->acc[i];
+}
+
+/* make the system calls for the tests of e ahead of them */
 static void
-test(const char *path, const char *name)
+gather(struct entry *e, int what)
 {
-	struct stat st, ln;
+	int i;
+
+	if (what & GatherStat) {
+		e->stok = !stat(e->path, &e->st);
+		e->lnok = FLAG('h') && !lstat(e->path, &e->ln);
+	}
+	if (what & GatherAccess && e->stok)
+		for (i = 0; i < 4; i++)
+			if (FLAG(accflag[i]))
+				can(e, i);
+}
+
+static void *
+worker(void *arg)
+{
+	struct job *j = arg;
+	size_t i;
+
+	while ((i = __sync_fetch_and_add(&j->next, 1)) < j->n)
+		gather(&j->v[i], j->what);
+	return NULL;
+}
+
+/* gather the entries of v on a pool of threads */
+static void
+pool(struct entry *v, size_t n, int what)
+{
+	pthread_t th[NTHREADS];
+	struct job j = { v, n, 0, what };
+	size_t i, nth;
+
+	for (nth = 0; nth < NTHREADS && nth < n; nth++)
+		if (pthread_create(&th[nth], NULL, worker, &j))
+			break;
+	worker(&j);
+	for (i = 0; i < nth; i++)
+		pthread_join(th[i], NULL);
+}
+
+#ifdef IOURING
+static struct {
+	int fd, state; /* state: 0 not set up yet, 1 usable, -1 unavailable */
+	unsigned *sqtail, *sqmask, *sqarray, *cqhead, *cqtail, *cqmask, entries;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+} ring;
+
+/* submit the queued n operations and wait for them; complete is called
+ * with each result */
+static int
+ringrun(unsigned n, void (*complete)(unsigned long long, int, void *), void *arg)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head, done = 0;
+	int r;
+
+	__atomic_store_n(ring.sqtail, *ring.sqtail + n, __ATOMIC_RELEASE);
+	for (r = n; done < n; r = 0) {
+		if (syscall(__NR_io_uring_enter, ring.fd, r, n - done,
+		            IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+			return 0;
+		head = *ring.cqhead;
+		for (; head != __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE); head++, done++) {
+			cqe = &ring.cqes[head & *ring.cqmask];
+			complete(cqe->user_data, cqe->res, arg);
+		}
+		__atomic_store_n(ring.cqhead, head, __ATOMIC_RELEASE);
+	}
+	return 1;
+}
+
+/* queue the i-th operation: a statx of path into sx */
+static void
+ringstatx(unsigned i, const char *path, int flags, struct statx *sx, unsigned long long data)
+{
+	unsigned k = (*ring.sqtail + i) & *ring.sqmask;
+	struct io_uring_sqe *sqe = &ring.sqes[k];
+
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long long)(size_t)path;
+	sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+	sqe->off = (unsigned long long)(size_t)sx;
+	sqe->statx_flags = flags;
+	sqe->user_data = data;
+	ring.sqarray[k] = k;
+}
+
+static void
+probed(unsigned long long data, int res, void *arg)
+{
+	*(int *)arg = res != -EINVAL; /* kernels before 5.6 know no statx */
+}
+
+static int
+ringsetup(void)
+{
+	struct io_uring_params p;
+	struct statx sx;
+	size_t sqsize, cqsize;
+	char *sq, *cq;
+	int ok = 0;
+
+	memset(&p, 0, sizeof p);
+	if ((ring.fd = syscall(__NR_io_uring_setup, RINGSIZE, &p)) < 0)
+		return 0;
+	sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sqsize = cqsize = sqsize > cqsize ? sqsize : cqsize;
+	if ((sq = mmap(NULL, sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	               ring.fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else if ((cq = mmap(NULL, cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                    ring.fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+		goto fail;
+	if ((ring.sqes = mmap(NULL, p.sq_entries * sizeof *ring.sqes, PROT_READ | PROT_WRITE,
+	                      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES)) == MAP_FAILED)
+		goto fail;
+	ring.sqtail = (unsigned *)(sq + p.sq_off.tail);
+	ring.sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring.sqarray = (unsigned *)(sq + p.sq_off.array);
+	ring.cqhead = (unsigned *)(cq + p.cq_off.head);
+	ring.cqtail = (unsigned *)(cq + p.cq_off.tail);
+	ring.cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ring.entries = p.sq_entries;
+
+	ringstatx(0, "/", 0, &sx, 0);
+	if (ringrun(1, probed, &ok) && ok)
+		return 1;
+fail:
+	close(ring.fd);
+	return 0;
+}
 
-	if ((!stat(path, &st) && (FLAG('a') || name[0] != '.')        /* hidden files      */
-	&& (!FLAG('b') || S_ISBLK(st.st_mode))                        /* block special     */
-	&& (!FLAG('c') || S_ISCHR(st.st_mode))                        /* character special */
-	&& (!FLAG('d') || S_ISDIR(st.st_mode))                        /* directory         */
-	&& (!FLAG('e') || access(path, F_OK) == 0)                    /* exists            */
-	&& (!FLAG('f') || S_ISREG(st.st_mode))                        /* regular file      */
-	&& (!FLAG('g') || st.st_mode & S_ISGID)                       /* set-group-id flag */
-	&& (!FLAG('h') || (!lstat(path, &ln) && S_ISLNK(ln.st_mode))) /* symbolic link     */
-	&& (!FLAG('n') || st.st_mtime > new.st_mtime)                 /* newer than file   */
-	&& (!FLAG('o') || st.st_mtime < old.st_mtime)                 /* older than file   */
-	&& (!FLAG('p') || S_ISFIFO(st.st_mode))                       /* named pipe        */
-	&& (!FLAG('r') || access(path, R_OK) == 0)                    /* readable          */
-	&& (!FLAG('s') || st.st_size > 0)                             /* not empty         */
-	&& (!FLAG('u') || st.st_mode & S_ISUID)                       /* set-user-id flag  */
-	&& (!FLAG('w') || access(path, W_OK) == 0)                    /* writable          */
-	&& (!FLAG('x') || access(path, X_OK) == 0)) != FLAG('v')) {   /* executable        */
+static void
+fromstatx(struct stat *st, const struct statx *sx)
+{
+	memset(st, 0, sizeof *st);
+	st->st_mode = sx->stx_mode;
+	st->st_size = sx->stx_size;
+	st->st_mtime = sx->stx_mtime.tv_sec;
+}
+
+struct ringbatch {
+	struct entry *v;
+	struct statx *sx;
+};
+
+static void
+statxed(unsigned long long op, int res, void *arg)
+{
+	struct ringbatch *b = arg;
+	struct entry *e = &b->v[op / 2];
+
+	if (op % 2) {
+		if ((e->lnok = !res))
+			fromstatx(&e->ln, &b->sx[op]);
+	} else if ((e->stok = !res)) {
+		fromstatx(&e->st, &b->sx[op]);
+	}
+}
+
+/* stat, and lstat for -h, the entries of v through io_uring */
+static int
+ringgather(struct entry *v, size_t n)
+{
+	static struct statx sx[2 * BATCH];
+	struct ringbatch b = { v, sx };
+	size_t op, nops = 2 * n;
+	unsigned k;
+
+	if (!ring.state)
+		ring.state = ringsetup() ? 1 : -1;
+	if (ring.state < 0)
+		return 0;
+	for (op = 0; op < nops; ) {
+		for (k = 0; k < ring.entries && op < nops; op++) {
+			if (op % 2 && !FLAG('h')) {
+				v[op / 2].lnok = 0;
+				continue;
+			}
+			ringstatx(k++, v[op / 2].path, op % 2 ? AT_SYMLINK_NOFOLLOW : 0,
+			          &sx[op], op);
+		}
+		if (k && !ringrun(k, statxed, &b)) {
+			ring.state = -1;
+			return 0;
+		}
+	}
+	return 1;
+}
+#endif
+
+/* gather v[0..n) in parallel, through io_uring where possible */
+static void
+gatherall(struct entry *v, size_t n)
+{
+	int i, what = GatherStat | GatherAccess;
+
+#ifdef IOURING
+	if (ringgather(v, n))
+		what = GatherAccess;
+#endif
+	for (i = 0; i < 4 && !FLAG(accflag[i]); i++)
+		;
+	if (what == GatherAccess && i == 4)
+		return;
+	pool(v, n, what);
+}
+
+static void
+test(struct entry *e, const char *name)
+{
+	struct stat *st = &e->st;
+
+	if ((e->stok && (FLAG('a') || name[0] != '.')               /* hidden files      */
+	&& (!FLAG('b') || S_ISBLK(st->st_mode))                       /* block special     */
+	&& (!FLAG('c') || S_ISCHR(st->st_mode))                       /* character special */
+	&& (!FLAG('d') || S_ISDIR(st->st_mode))                       /* directory         */
+	&& (!FLAG('e') || can(e, 0))                                  /* exists            */
+	&& (!FLAG('f') || S_ISREG(st->st_mode))                       /* regular file      */
+	&& (!FLAG('g') || st->st_mode & S_ISGID)                      /* set-group-id flag */
+	&& (!FLAG('h') || (e->lnok && S_ISLNK(e->ln.st_mode)))        /* symbolic link     */
+	&& (!FLAG('n') || st->st_mtime > new.st_mtime)                /* newer than file   */
+	&& (!FLAG('o') || st->st_mtime < old.st_mtime)                /* older than file   */
+	&& (!FLAG('p') || S_ISFIFO(st->st_mode))                      /* named pipe        */
+	&& (!FLAG('r') || can(e, 1))                                  /* readable          */
+	&& (!FLAG('s') || st->st_size > 0)                            /* not empty         */
+	&& (!FLAG('u') || st->st_mode & S_ISUID)                      /* set-user-id flag  */
+	&& (!FLAG('w') || can(e, 2))                                  /* writable          */
+	&& (!FLAG('x') || can(e, 3))) != FLAG('v')) {                 /* executable        */
 		if (FLAG('q'))
 			exit(0);
 		match = 1;
@@ -48,10 +304,57 @@ test(const char *path, const char *name)
 	}
 }
 
+static void
+testpath(const char *path, const char *name)
+{
+	struct entry e = { path, .acc = { -1, -1, -1, -1 } };
+
+	gather(&e, GatherStat);
+	test(&e, name);
+}
+
+/* test the paths on stdin in batches whose system calls are made in
+ * parallel, in input order */
+static void
+testbatch(void)
+{
+	struct entry *v;
+	char *line = NULL;
+	size_t linesiz = 0, n = 0, i;
+	ssize_t len;
+
+	if (!(v = calloc(BATCH, sizeof *v))) {
+		perror("calloc");
+		exit(2);
+	}
+	do {
+		if ((len = getline(&line, &linesiz, stdin)) > 0) {
+			if (line[len - 1] == '\n')
+				line[len - 1] = '\0';
+			if (!(v[n].path = strdup(line))) {
+				perror("strdup");
+				exit(2);
+			}
+			memset(v[n].acc, -1, sizeof v[n].acc);
+			n++;
+		}
+		if (n == BATCH || (len <= 0 && n)) {
+			gatherall(v, n);
+			for (i = 0; i < n; i++) {
+				test(&v[i], v[i].path);
+				free((char *)v[i].path);
+			}
+			n = 0;
+		}
+	} while (len > 0);
+	free(line);
+	free(v);
+}
+
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-abcdefghlpqrsuvwx] "
+	fprintf(stderr, "usage: %s [-abcdefghjlpqrsuvwx] "
 	        "[-n file] [-o file] [file...]\n", argv0);
 	exit(2); /* like test(1) return > 1 on error */
 }
@@ -75,18 +378,20 @@ main(int argc, char *argv[])
 		break;
 	default:
 		/* miscellaneous operators */
-		if (strchr("abcdefghlpqrsuvwx", ARGC()))
+		if (strchr("abcdefghjlpqrsuvwx", ARGC()))
 			FLAG(ARGC()) = 1;
 		else
 			usage(); /* unknown flag */
 	} ARGEND;
 
-	if (!argc) {
+	if (!argc && FLAG('j')) {
+		testbatch();
+	} else if (!argc) {
 		/* read list from stdin */
 		while ((n = getline(&line, &linesiz, stdin)) > 0) {
 			if (line[n - 1] == '\n')
 				line[n - 1] = '\0';
-			test(line, line);
+			testpath(line, line);
 		}
 		free(line);
 	} else {
@@ -97,11 +402,11 @@ main(int argc, char *argv[])
 					r = snprintf(path, sizeof path, "%s/%s",
 					             *argv, d->d_name);
 					if (r >= 0 && (size_t)r < sizeof path)
-						test(path, d->d_name);
+						testpath(path, d->d_name);
 				}
 				closedir(dir);
 			} else {
-				test(*argv, *argv);
+				testpath(*argv, *argv);
 			}
 		}
 	}